@@ -0,0 +1,355 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Opening book
+//
+// https://www.chessprogramming.org/Opening_Book
+
+#include "./book.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "./fen.h"
+#include "./search.h"
+#include "./tbassert.h"
+
+// A move played in a position of the book, and how often it was played there.
+// Symmetric positions share their records: the key is the canonical key of
+// the position, and the move is the one of its canonical image.
+typedef struct {
+  uint64_t key;     // canonical_key of the position
+  uint32_t move;
+  uint32_t weight;
+} bookRecord_t;
+
+// header of a file written by book_build; the records follow, sorted by key
+// and then by move
+#define BOOK_FILE_MAGIC "LSCHSBK"
+#define BOOK_FILE_VERSION 2
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t bytes_per_record;
+  uint64_t num_records;
+  uint64_t zob_fingerprint;  // the book is only valid with the same keys
+} bookFileHeader_t;
+
+// Lines played when no book file is loaded, in the format of tests/book.dta.
+// g4L is listed twice so that it outweighs f3L as the first move of White.
+static char* builtin_lines[] = {
+  "g4L b3L",
+  "g4L b3L",
+  "f3L b3L",
+};
+
+// the book in use
+static const bookRecord_t* book_records;
+static uint64_t book_size;
+static void* book_mapping;          // the mapped file, if book_records is in one
+static size_t book_mapping_bytes;
+static bookRecord_t* book_builtin;  // the built-in book, if book_records is it
+
+// Records collected by the builder
+typedef struct {
+  bookRecord_t* records;
+  uint64_t      size;
+  uint64_t      capacity;
+} bookBuilder_t;
+
+static int compare_records(const void* a, const void* b) {
+  const bookRecord_t* x = a;
+  const bookRecord_t* y = b;
+  if (x->key != y->key) {
+    return x->key < y->key ? -1 : 1;
+  }
+  if (x->move != y->move) {
+    return x->move < y->move ? -1 : 1;
+  }
+  return 0;
+}
+
+static bool add_record(bookBuilder_t* b, uint64_t key, move_t mv) {
+  if (b->size == b->capacity) {
+    uint64_t capacity = b->capacity ? 2 * b->capacity : 1024;
+    bookRecord_t* records = realloc(b->records, capacity * sizeof(bookRecord_t));
+    if (records == NULL) {
+      fprintf(stderr, "Out of memory for %"PRIu64" book records\n", capacity);
+      return false;
+    }
+    b->records = records;
+    b->capacity = capacity;
+  }
+  b->records[b->size].key = key;
+  b->records[b->size].move = mv;
+  b->records[b->size].weight = 1;
+  b->size++;
+  return true;
+}
+
+// Sorts the records and merges the ones for the same move in the same
+// position, adding up their weights.
+static void merge_records(bookBuilder_t* b) {
+  qsort(b->records, b->size, sizeof(bookRecord_t), compare_records);
+  uint64_t n = 0;
+  for (uint64_t i = 0; i < b->size; i++) {
+    if (n > 0 && compare_records(&b->records[n - 1], &b->records[i]) == 0) {
+      b->records[n - 1].weight += b->records[i].weight;
+    } else {
+      b->records[n++] = b->records[i];
+    }
+  }
+  b->size = n;
+}
+
+// The move of p written as str, or 0 if p has no such move.
+static move_t move_of_string(position_t* p, const char* str) {
+  sortable_move_t lst[MAX_NUM_MOVES];
+  int move_count = generate_all(p, lst, true);
+  for (int i = 0; i < move_count; i++) {
+    char buf[MAX_CHARS_IN_MOVE];
+    move_to_str(get_move(lst[i]), buf, MAX_CHARS_IN_MOVE);
+    if (strcasecmp(buf, str) == 0) {
+      return get_move(lst[i]);
+    }
+  }
+  return 0;
+}
+
+// Plays the game in line, a string of moves from the start position in which
+// anything that is not a move (move numbers, {comments}, results) is
+// skipped, and adds a record for each of its first max_plies moves.  A game
+// ends at the first move that is not legal.
+static bool add_line(bookBuilder_t* b, char* line, int max_plies) {
+  static position_t game[MAX_PLY_IN_GAME];
+  int ply = 0;
+  fen_to_pos(&game[0], "");
+
+  bool in_comment = false;
+  for (char* tok = strtok(line, " \t\r\n"); tok != NULL && ply < max_plies &&
+       ply + 1 < MAX_PLY_IN_GAME; tok = strtok(NULL, " \t\r\n")) {
+    if (in_comment || tok[0] == '{') {
+      in_comment = strchr(tok, '}') == NULL;
+      continue;
+    }
+    if (isdigit(tok[0]) && (strchr(tok, '.') != NULL || strchr(tok, '-') != NULL)) {
+      continue;  // a move number or a result
+    }
+
+    move_t mv = move_of_string(&game[ply], tok);
+    if (mv == 0 || is_KO(make_move(&game[ply], &game[ply + 1], mv))) {
+      break;
+    }
+    int sym;
+    uint64_t key = canonical_key(&game[ply], &sym);
+    if (!add_record(b, key, sym_move(sym, mv))) {
+      return false;
+    }
+    ply++;
+    if (victim_exists(game[ply].victims) &&
+        ptype_of(game[ply].victims.zapped) == KING) {
+      break;
+    }
+  }
+  return true;
+}
+
+// Feeds the games in filename to add_line.  In a PGN file the movetext of a
+// game follows its tag lines; any other file has one game per line.
+static bool add_file(bookBuilder_t* b, const char* filename, int max_plies) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+
+  const char* ext = strrchr(filename, '.');
+  bool pgn = ext != NULL && strcasecmp(ext, ".pgn") == 0;
+
+  size_t capacity = 1 << 16;
+  size_t len = 0;
+  char* game = malloc(capacity);
+  char line[4096];
+  bool ok = game != NULL;
+  if (ok) {
+    game[0] = '\0';
+  }
+
+  while (ok && fgets(line, sizeof(line), f) != NULL) {
+    if (!pgn) {
+      ok = add_line(b, line, max_plies);
+      continue;
+    }
+    if (line[0] == '[') {  // tags start the next game
+      if (len > 0) {
+        ok = add_line(b, game, max_plies);
+        len = 0;
+        game[0] = '\0';
+      }
+      continue;
+    }
+    size_t n = strlen(line);
+    if (len + n + 1 > capacity) {
+      capacity = 2 * (len + n + 1);
+      char* bigger = realloc(game, capacity);
+      if (bigger == NULL) {
+        ok = false;
+        break;
+      }
+      game = bigger;
+    }
+    memcpy(game + len, line, n + 1);
+    len += n;
+  }
+  if (ok && pgn && len > 0) {
+    ok = add_line(b, game, max_plies);
+  }
+
+  free(game);
+  fclose(f);
+  return ok;
+}
+
+static void book_unload() {
+  if (book_mapping != NULL) {
+    munmap(book_mapping, book_mapping_bytes);
+    book_mapping = NULL;
+  }
+  free(book_builtin);
+  book_builtin = NULL;
+  book_records = NULL;
+  book_size = 0;
+}
+
+void book_load_builtin() {
+  bookBuilder_t b = {NULL, 0, 0};
+  for (size_t i = 0; i < sizeof(builtin_lines) / sizeof(builtin_lines[0]); i++) {
+    char line[MAX_CHARS_IN_TOKEN];
+    snprintf(line, sizeof(line), "%s", builtin_lines[i]);
+    add_line(&b, line, MAX_PLY_IN_GAME);
+  }
+  merge_records(&b);
+
+  book_unload();
+  book_builtin = b.records;
+  book_records = b.records;
+  book_size = b.size;
+}
+
+bool book_build(const char* filename, int max_plies, char** inputs,
+                int num_inputs) {
+  bookBuilder_t b = {NULL, 0, 0};
+  bool ok = true;
+  for (int i = 0; i < num_inputs && ok; i++) {
+    ok = add_file(&b, inputs[i], max_plies);
+  }
+  if (!ok) {
+    free(b.records);
+    return false;
+  }
+  merge_records(&b);
+
+  bookFileHeader_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BOOK_FILE_MAGIC, sizeof(header.magic));
+  header.version = BOOK_FILE_VERSION;
+  header.bytes_per_record = sizeof(bookRecord_t);
+  header.num_records = b.size;
+  header.zob_fingerprint = zob_fingerprint();
+
+  FILE* f = fopen(filename, "wb");
+  ok = f != NULL && fwrite(&header, sizeof(header), 1, f) == 1 &&
+       fwrite(b.records, sizeof(bookRecord_t), b.size, f) == b.size;
+  if (f == NULL || fclose(f) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    perror(filename);
+  }
+  free(b.records);
+  return ok && book_load(filename);
+}
+
+bool book_load(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  bookFileHeader_t header;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, BOOK_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s: not an opening book file\n", filename);
+    close(fd);
+    return false;
+  }
+  if (header.version != BOOK_FILE_VERSION ||
+      header.bytes_per_record != sizeof(bookRecord_t) ||
+      header.zob_fingerprint != zob_fingerprint() ||
+      (size_t) st.st_size !=
+      sizeof(header) + header.num_records * sizeof(bookRecord_t)) {
+    fprintf(stderr, "%s: opening book does not match this build\n", filename);
+    close(fd);
+    return false;
+  }
+
+  void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    perror(filename);
+    return false;
+  }
+
+  book_unload();
+  book_mapping = mem;
+  book_mapping_bytes = st.st_size;
+  book_records = (const bookRecord_t*) ((char*) mem + sizeof(header));
+  book_size = header.num_records;
+  return true;
+}
+
+uint64_t book_num_records() {
+  return book_size;
+}
+
+move_t book_probe(position_t* p) {
+  int sym;
+  uint64_t key = canonical_key(p, &sym);
+  int back = sym_inverse(sym);
+
+  // first record with a key not less than key
+  uint64_t lo = 0;
+  uint64_t hi = book_size;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (book_records[mid].key < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  // the legal move played most often; keys can collide, so check the move
+  move_t best = 0;
+  uint32_t best_weight = 0;
+  position_t next;
+  for (uint64_t i = lo; i < book_size && book_records[i].key == key; i++) {
+    move_t mv = sym_move(back, book_records[i].move);
+    if (book_records[i].weight > best_weight && is_generated_move(p, mv) &&
+        !is_KO(make_move(p, &next, mv))) {
+      best = mv;
+      best_weight = book_records[i].weight;
+    }
+  }
+  return best;
+}
@@ -0,0 +1,29 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Opening book
+
+#ifndef BOOK_H
+#define BOOK_H
+
+#include <stdbool.h>
+
+#include "./move_gen.h"
+
+// Builds a book from the first max_plies moves of the games in inputs, writes
+// it to filename, and loads it.  Inputs are PGN files written by the
+// autotester (*.pgn) or files with one game per line, like tests/book.dta.
+bool book_build(const char* filename, int max_plies, char** inputs,
+                int num_inputs);
+
+// Memory-maps the book in filename, replacing the one in use.
+bool book_load(const char* filename);
+
+// Replaces the book in use with the few lines built into the engine.
+void book_load_builtin();
+
+uint64_t book_num_records();
+
+// The book move played most often in p, or 0 if p is not in the book.
+move_t book_probe(position_t* p);
+
+#endif  // BOOK_H
@@ -2,6 +2,8 @@
 
 #include "./end_game.h"
 
+#include "./tablebase.h"
+
 // check the victim pieces returned by the move to determine if it's a
 // game-over situation.  If so, also calculate the score depending on
 // the pov (which player's point of view)
@@ -29,13 +31,24 @@ static score_t get_game_over_score(victims_t victims, int pov, int ply) {
 }
 
 
-// Here's a great spot to add in a closing book/end game table if you choose to implement one.
+// Positions with few Pawns are looked up in the tablebases, see tablebase.h.
+// Only wins and losses end the search there: the tables know nothing of the
+// Ko rule or of repetitions, so their draws are left to the search.  Their
+// wins and losses hold under the Ko rule, which only forbids undoing the
+// last move of the opponent.  That is never the fastest win: it gives the
+// opponent back a position it was not lost in, or lost in more plies.  And
+// the loser only loses moves to the rule.  Distances may come out long when
+// the longest defense of the tables undoes a move.
 
 // In this function, determine if the position is in the end game table or not.
 bool is_end_game_position(position_t* p, int pov, int ply) {
   // Note: pov and ply are for the move that *generated* this position, not the position itself.
   //       This means you might have an off-by-one error when reading from your closing book.
-  return is_game_over(p->victims, pov, ply);
+  if (is_game_over(p->victims, pov, ply)) {
+    return true;
+  }
+  int result, distance;
+  return tb_probe(p, &result, &distance) && result != 0;
 }
 
 // In this function, read the end game table and return the score of this position,
@@ -48,5 +61,14 @@ bool is_end_game_position(position_t* p, int pov, int ply) {
 score_t get_end_game_score(position_t* p, int pov, int ply) {
   // Note: pov and ply are for the move that *generated* this position, not the position itself.
   //       This means you might have an off-by-one error when reading from your closing book.
+  if (is_game_over(p->victims, pov, ply)) {
     return get_game_over_score(p->victims, pov, ply);
+  }
+
+  // The table scores p for its side to move, the opponent of the player
+  // whose move at ply generated p, so the game ends distance plies after ply.
+  int result, distance;
+  tb_probe(p, &result, &distance);
+  score_t score = WIN - (ply + distance);
+  return result > 0 ? -score : score;
 }
@@ -6,9 +6,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 #include "./move_gen.h"
 #include "./tbassert.h"
 
+#define MAX(x, y)  ((x) > (y) ? (x) : (y))
+#define MIN(x, y)  ((x) < (y) ? (x) : (y))
+
 // -----------------------------------------------------------------------------
 // Evaluation
 // -----------------------------------------------------------------------------
@@ -24,6 +28,12 @@ int KFACE;
 int KAGGRESSIVE;
 int MOBILITY;
 int LCOVERAGE;
+int FAST_COVERAGE;     // Fixed-point coverage from the moves that touch the beam
+int INCREMENTAL_EVAL;  // Use the running sums kept by make_move in the search
+int CHECK_EVAL;        // Compare every incremental eval against the full one
+
+// MATERIAL plus PCENTRAL for a Pawn on each square, indexed like a bitboard
+int32_t pawn_psq_table[BB_SIZE];
 
 // Heuristics for static evaluation - described in the google doc
 // mentioned in the handout.
@@ -132,37 +142,8 @@ ev_score_t kaggressive(position_t* p, fil_t f, rnk_t r) {
 // mark_mask : What each square is marked with.
 void mark_laser_path(position_t* p, color_t c, char* laser_map,
                      char mark_mask) {
-  square_t sq = p->kloc[c];
-  int bdir = ori_of(p->board[sq]);
-
-  tbassert(ptype_of(p->board[sq]) == KING,
-           "ptype: %d\n", ptype_of(p->board[sq]));
-  laser_map[sq] |= mark_mask;
-
-  while (true) {
-    sq += beam_of(bdir);
-    laser_map[sq] |= mark_mask;
-    tbassert(sq < ARR_SIZE && sq >= 0, "sq: %d\n", sq);
-
-    switch (ptype_of(p->board[sq])) {
-    case EMPTY:  // empty square
-      break;
-    case PAWN:  // Pawn
-      bdir = reflect_of(bdir, ori_of(p->board[sq]));
-      if (bdir < 0) {  // Hit back of Pawn
-        return;
-      }
-      break;
-    case KING:  // King
-      return;  // sorry, game over my friend!
-      break;
-    case INVALID:  // Ran off edge of board
-      return;
-      break;
-    default:  // Shouldna happen, man!
-      tbassert(false, "Not cool, man.  Not cool.\n");
-      break;
-    }
+  for (bitboard_t b = p->laser[c].squares; b; b &= b - 1) {
+    laser_map[square_of_bb_index(__builtin_ctzll(b))] |= mark_mask;
   }
 }
 
@@ -176,49 +157,36 @@ void mark_laser_path(position_t* p, color_t c, char* laser_map,
 //             path of the laser is marked with mark_mask.
 // mark_mask : What each square is marked with.
 void add_laser_path(position_t* p, color_t c, float* laser_map) {
+  laser_path_t* lp = &p->laser[c];
   square_t sq = p->kloc[c];
   int bdir = ori_of(p->board[sq]);
   int length = 1;
 
   tbassert(ptype_of(p->board[sq]) == KING,
            "ptype: %d\n", ptype_of(p->board[sq]));
-  // laser_map[sq] += touch_weight;
-
-  while (true) {
-    sq += beam_of(bdir);
 
-    // set laser map to min
-    if(laser_map[sq] > length) {
-      laser_map[sq] = length;
-    }
-    length++;
-    
-    tbassert(sq < ARR_SIZE && sq >= 0, "sq: %d\n", sq);
-
-    switch (ptype_of(p->board[sq])) {
-    case EMPTY:  // empty square
-      break;
-    case PAWN:  // Pawn
-      bdir = reflect_of(bdir, ori_of(p->board[sq]));
-      if (bdir < 0) {  // Hit back of Pawn
-        return;
+  // Walk the cached path one straight segment at a time.
+  for (int k = 0; k <= lp->num_bounces; k++) {
+    square_t seg_end = (k < lp->num_bounces) ? lp->bounce_sq[k] : lp->end;
+    int seg_len = __builtin_popcountll(bb_ray(sq, bdir, seg_end));
+    int step = beam_of(bdir);
+
+    for (int i = 0; i < seg_len; i++) {
+      sq += step;
+      // set laser map to min
+      if (laser_map[sq] > length) {
+        laser_map[sq] = length;
       }
+      length++;
+    }
 
+    if (k < lp->num_bounces) {
       // if bouncing off an opposing pawn, add extra to the length of path
-      // because the opponent can affect it 
+      // because the opponent can affect it
       if (color_of(p->board[sq]) != c) {
         length += 2;
       }
-      break;
-    case KING:  // King
-      return;  // sorry, game over my friend!
-      break;
-    case INVALID:  // Ran off edge of board
-      return;
-      break;
-    default:  // Shouldna happen, man!
-      tbassert(false, "Not cool, man.  Not cool.\n");
-      break;
+      bdir = lp->bounce_dir[k];
     }
   }
 }
@@ -241,7 +209,7 @@ int manhattan_dist(square_t a, square_t b) {
 }
 
 float laser_coverage(position_t* p, color_t color) {
-  position_t np;
+  undo_t u;
   sortable_move_t moves[MAX_NUM_MOVES];
   int num_moves = generate_all_with_color(p, moves, color);
   int i;
@@ -257,9 +225,11 @@ float laser_coverage(position_t* p, color_t color) {
   for(i = 0; i < num_moves; i++) {
     move_t mv = get_move(moves[i]);
 
-    low_level_make_move(p, &np, mv); // make the move
+    low_level_make_move_in_place(p, mv, &u); // make the move
+
+    add_laser_path(p, color, coverage_map);  // increment laser path
 
-    add_laser_path(&np, color, coverage_map);  // increment laser path
+    unmake_move(p, &u);
   }
 
   // get square of opposing king
@@ -275,8 +245,8 @@ float laser_coverage(position_t* p, color_t color) {
   for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
     for (rnk_t r = 0; r < BOARD_WIDTH; ++r) {
       if (coverage_map[square_of(f, r)] < FLT_MAX) {
-        // length of path divided by length of shortest possible path
-        tbassert(manhattan_dist(king_sq, square_of(f, r)) <= coverage_map[square_of(f, r)], "f: %d, r: %d, dist = %d, map: %f\n", f, r, manhattan_dist(king_sq, square_of(f, r)), coverage_map[square_of(f, r)]);
+        // length of path divided by length of shortest possible path.  This
+        // can exceed 1: a King move starts the beam from another square.
 
         // printf("before: %f, dist: %d\n", coverage_map[square_of(f, r)], manhattan_dist(king_sq, square_of(f, r)));
         coverage_map[square_of(f, r)] = ((manhattan_dist(king_sq, square_of(f, r))) / (coverage_map[square_of(f, r)]));
@@ -317,40 +287,142 @@ float laser_coverage(position_t* p, color_t color) {
   return result;
 }
 
-// MOBILITY heuristic: safe squares around king of given color.
-int mobility(position_t* p, color_t color) {
-  color_t c = opp_color(color);
-  char laser_map[ARR_SIZE];
+// mult_dist scaled by 2^16, indexed by file and rank distance
+static int64_t mult_dist_fixed[BOARD_WIDTH][BOARD_WIDTH];
+// The off-board part of laser_coverage scaled by 2^16, indexed by the bitboard
+// index of the opposing King
+static int64_t off_board_fixed[BB_SIZE];
+
+void init_coverage_tables() {
+  for (int df = 0; df < BOARD_WIDTH; df++) {
+    for (int dr = 0; dr < BOARD_WIDTH; dr++) {
+      mult_dist_fixed[df][dr] = (df == 0 && dr == 0) ?
+          2 << 16 : (1 << 16) / ((df + 1) * (dr + 1));
+    }
+  }
 
-  for (int i = 0; i < ARR_SIZE; ++i) {
-    laser_map[i] = 4;   // Invalid square
+  for (int i = 0; i < BB_SIZE; i++) {
+    int kf = i / BOARD_WIDTH;
+    int kr = i % BOARD_WIDTH;
+    int64_t sum = 0;
+    for (int f = -1; f <= BOARD_WIDTH; f++) {
+      for (int r = -1; r <= BOARD_WIDTH; r++) {
+        if (f == -1 || f == BOARD_WIDTH || r == -1 || r == BOARD_WIDTH) {
+          sum += (1 << 16) / ((abs(f - kf) + 1) * (abs(r - kr) + 1));
+        }
+      }
+    }
+    off_board_fixed[i] = sum;
   }
+}
 
-  for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
-    for (rnk_t r = 0; r < BOARD_WIDTH; ++r) {
-      laser_map[square_of(f, r)] = 0;
+// Like add_laser_path, but with integer lengths.  Returns the squares marked.
+static bitboard_t add_laser_lengths(position_t* p, color_t c,
+                                    uint16_t* lengths) {
+  laser_path_t* lp = &p->laser[c];
+  square_t sq = p->kloc[c];
+  int bdir = ori_of(p->board[sq]);
+  int length = 1;
+  bitboard_t marked = 0;
+
+  for (int k = 0; k <= lp->num_bounces; k++) {
+    square_t seg_end = (k < lp->num_bounces) ? lp->bounce_sq[k] : lp->end;
+    bitboard_t segment = bb_ray(sq, bdir, seg_end);
+    int seg_len = __builtin_popcountll(segment);
+    int step = beam_of(bdir);
+    marked |= segment;
+
+    for (int i = 0; i < seg_len; i++) {
+      sq += step;
+      if (lengths[sq] > length) {
+        lengths[sq] = length;
+      }
+      length++;
+    }
+
+    if (k < lp->num_bounces) {
+      if (color_of(p->board[sq]) != c) {
+        length += 2;
+      }
+      bdir = lp->bounce_dir[k];
     }
   }
+  return marked;
+}
+
+// LCOVERAGE * laser_coverage(p, color), computed in fixed point.  A move
+// changes the beam only if it touches one of the squares on it, so every
+// other move contributes the current beam, and only the pieces within two
+// steps of the beam (a swap moves a piece two squares) need their moves made.
+static ev_score_t fast_laser_coverage(position_t* p, color_t color) {
+  undo_t u;
+  sortable_move_t moves[MAX_NUM_MOVES];
+  uint16_t lengths[ARR_SIZE];
+  bitboard_t beam = p->laser[color].squares;
+  bitboard_t pawns = p->bb_pieces[color][PAWN - PAWN];
+  bitboard_t covered = 0;
+
+  memset(lengths, 0xff, sizeof(lengths));
 
-  mark_laser_path(p, c, laser_map, 1);  // find path of laser given that you aren't moving
+  // Rotating a Pawn off the beam leaves it alone.
+  if (pawns & ~beam) {
+    covered |= add_laser_lengths(p, color, lengths);
+  }
+
+  bitboard_t near = beam | bb_neighbors(beam);
+  near |= bb_neighbors(near);
+  int num_moves = generate_moves_from(p, moves, color, near);
+
+  for (int i = 0; i < num_moves; i++) {
+    move_t mv = get_move(moves[i]);
+    bitboard_t touched = bb_of_square(from_square(mv)) |
+                         bb_of_square(intermediate_square(mv)) |
+                         bb_of_square(to_square(mv));
+    if (!(touched & beam)) {
+      continue;  // same beam as p, already counted
+    }
+    low_level_make_move_in_place(p, mv, &u);
+    covered |= add_laser_lengths(p, color, lengths);
+    unmake_move(p, &u);
+  }
+
+  // Bitboard indices of the two Kings
+  int k = __builtin_ctzll(p->bb_pieces[color][KING - PAWN]);
+  int ok = __builtin_ctzll(p->bb_pieces[opp_color(color)][KING - PAWN]);
+
+  int64_t result = off_board_fixed[ok] << 16;
+  for (; covered; covered &= covered - 1) {
+    int i = __builtin_ctzll(covered);
+    int man = abs(i / BOARD_WIDTH - k / BOARD_WIDTH) +
+              abs(i % BOARD_WIDTH - k % BOARD_WIDTH);
+    int64_t ratio = ((int64_t) man << 16) / lengths[square_of_bb_index(i)];
+    result += ratio * mult_dist_fixed[abs(i / BOARD_WIDTH - ok / BOARD_WIDTH)]
+                                     [abs(i % BOARD_WIDTH - ok % BOARD_WIDTH)];
+  }
+
+  return (LCOVERAGE * result) >> 32;
+}
+
+// LASER_COVERAGE bonus for color, from the engine chosen by fast_coverage
+static ev_score_t coverage_bonus(position_t* p, color_t color) {
+  if (FAST_COVERAGE) {
+    return fast_laser_coverage(p, color);
+  }
+  return (int) (LCOVERAGE * laser_coverage(p, color));
+}
 
-  int mobility = 0;
+// MOBILITY heuristic: safe squares around king of given color.
+int mobility(position_t* p, color_t color) {
   square_t king_sq = p->kloc[color];
   tbassert(ptype_of(p->board[king_sq]) == KING,
            "ptype: %d\n", ptype_of(p->board[king_sq]));
   tbassert(color_of(p->board[king_sq]) == color,
            "color: %d\n", color_of(p->board[king_sq]));
 
-  if (laser_map[king_sq] == 0) {
-    mobility++;
-  }
-  for (int d = 0; d < 8; ++d) {
-    square_t sq = king_sq + dir_of(d);
-    if (laser_map[sq] == 0) {
-      mobility++;
-    }
-  }
-  return mobility;
+  // squares the opposing laser passes through, given that you aren't moving
+  bitboard_t laser = p->laser[opp_color(color)].squares;
+  bitboard_t king = bb_of_square(king_sq);
+  return __builtin_popcountll((king | bb_neighbors(king)) & ~laser);
 }
 
 
@@ -365,13 +437,56 @@ float h_dist(square_t a, square_t b) {
   return x;
 }
 
-// Static evaluation.  Returns score
-score_t eval(position_t* p, bool verbose) {
-  // seed rand_r with a value of 1, as per
-  // http://linux.die.net/man/3/rand_r
-  static __thread unsigned int seed = 1;
-  // verbose = true: print out components of score
-  ev_score_t score[2] = { 0, 0 };
+// Pawns of either color inside the rectangle with corners a and b.
+static bitboard_t bb_rectangle(square_t a, square_t b) {
+  int f_lo = MIN(fil_of(a), fil_of(b));
+  int f_hi = MAX(fil_of(a), fil_of(b));
+  int r_lo = MIN(rnk_of(a), rnk_of(b));
+  int r_hi = MAX(rnk_of(a), rnk_of(b));
+  bitboard_t files = (2ULL << (BOARD_WIDTH * f_hi + BOARD_WIDTH - 1)) -
+                     (1ULL << (BOARD_WIDTH * f_lo));
+  bitboard_t ranks = ((2ULL << r_hi) - (1ULL << r_lo)) * BB_RANK_FIRST;
+  return files & ranks;
+}
+
+// Builds pawn_psq_table from the current weights.  Called whenever they
+// change, never while a search is running, as every search reads the table.
+void init_pawn_psq_table() {
+  for (fil_t f = 0; f < BOARD_WIDTH; f++) {
+    for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
+      // MATERIAL and PCENTRAL heuristics
+      pawn_psq_table[BOARD_WIDTH * f + r] = PAWN_EV_VALUE + pcentral(f, r);
+    }
+  }
+}
+
+// Recomputes the running sums of p from pawn_psq_table.  The search calls
+// this on its root position.
+void init_incremental_eval(position_t* p) {
+  for (color_t c = WHITE; c <= BLACK; c++) {
+    p->psq_score[c] = 0;
+    for (bitboard_t b = p->bb_pieces[c][PAWN - PAWN]; b; b &= b - 1) {
+      p->psq_score[c] += pawn_psq_table[__builtin_ctzll(b)];
+    }
+  }
+}
+
+// Per-color terms that only depend on the two Kings, plus PBETWEEN, which is
+// a bitboard count once the Kings are known.
+static void eval_king_terms(position_t* p, ev_score_t score[2]) {
+  bitboard_t between = bb_rectangle(p->kloc[WHITE], p->kloc[BLACK]);
+  for (color_t c = WHITE; c <= BLACK; c++) {
+    square_t sq = p->kloc[c];
+    score[c] += PBETWEEN *
+                __builtin_popcountll(p->bb_pieces[c][PAWN - PAWN] & between);
+    score[c] += kface(p, fil_of(sq), rnk_of(sq));
+    score[c] += kaggressive(p, fil_of(sq), rnk_of(sq));
+  }
+}
+
+// Per-piece terms, computed by scanning the whole board.
+// verbose = true: print out components of score
+static void eval_board_terms(position_t* p, bool verbose, ev_score_t score[2]) {
   //  int corner[2][2] = { {INF, INF}, {INF, INF} };
   ev_score_t bonus;
   char buf[MAX_CHARS_IN_MOVE];
@@ -434,21 +549,46 @@ score_t eval(position_t* p, bool verbose) {
       }
     }
   }
+}
+
+// Static evaluation from White's point of view, before randomization.
+//
+// incremental = true: take MATERIAL and PCENTRAL from the running sums kept
+//   in the position, and the King terms from the King locations, instead of
+//   scanning the board.
+// verbose = true: print out components of score (full evaluation only)
+static ev_score_t eval_total(position_t* p, bool verbose, bool incremental) {
+  ev_score_t score[2] = { 0, 0 };
+
+  if (incremental) {
+    score[WHITE] = p->psq_score[WHITE];
+    score[BLACK] = p->psq_score[BLACK];
+    eval_king_terms(p, score);
+  } else {
+    eval_board_terms(p, verbose, score);
+  }
 
   // LASER_COVERAGE heuristic
-  float w_coverage = LCOVERAGE * laser_coverage(p, WHITE);
-  score[WHITE] += (int) w_coverage;
+  ev_score_t w_coverage = coverage_bonus(p, WHITE);
+  score[WHITE] += w_coverage;
   if (verbose) {
-    printf("COVERAGE bonus %d for White\n",(int) w_coverage);
+    printf("COVERAGE bonus %d for White\n", w_coverage);
   }
-  float b_coverage = LCOVERAGE * laser_coverage(p, BLACK);
-  score[BLACK] += (int) b_coverage;
+  ev_score_t b_coverage = coverage_bonus(p, BLACK);
+  score[BLACK] += b_coverage;
   if (verbose) {
-    printf("COVERAGE bonus %d for Black\n",(int) b_coverage);
+    printf("COVERAGE bonus %d for Black\n", b_coverage);
   }
 
   // score from WHITE point of view
-  ev_score_t tot = score[WHITE] - score[BLACK];
+  return score[WHITE] - score[BLACK];
+}
+
+// Applies randomization and the point of view of the side to move.
+static score_t eval_score(position_t* p, ev_score_t tot) {
+  // seed rand_r with a value of 1, as per
+  // http://linux.die.net/man/3/rand_r
+  static __thread unsigned int seed = 1;
 
   if (RANDOMIZE) {
     ev_score_t  z = rand_r(&seed) % (RANDOMIZE * 2 + 1);
@@ -461,3 +601,30 @@ score_t eval(position_t* p, bool verbose) {
 
   return tot / EV_SCORE_RATIO;
 }
+
+// Static evaluation.  Returns score
+score_t eval(position_t* p, bool verbose) {
+  return eval_score(p, eval_total(p, verbose, false));
+}
+
+// Static evaluation using the running sums maintained by make_move.  Falls back
+// to eval() when the incremental_eval option is off.  With check_eval on, every
+// call is compared against the full evaluation and aborts on a mismatch.
+score_t eval_incremental(position_t* p) {
+  if (!INCREMENTAL_EVAL) {
+    return eval(p, false);
+  }
+
+  ev_score_t tot = eval_total(p, false, true);
+
+  if (CHECK_EVAL) {
+    ev_score_t full = eval_total(p, false, false);
+    if (tot != full) {
+      fprintf(stderr, "incremental eval %d != full eval %d\n", tot, full);
+      display(p);
+      abort();
+    }
+  }
+
+  return eval_score(p, tot);
+}
@@ -13,9 +13,17 @@
 // ev_score_t values
 #define PAWN_EV_VALUE (PAWN_VALUE*EV_SCORE_RATIO)
 
+// MATERIAL plus PCENTRAL for a Pawn on each square, indexed like a bitboard.
+// make_move keeps position_t.psq_score up to date with it.
+extern int32_t pawn_psq_table[BB_SIZE];
+
 void mark_laser_path(position_t* p, color_t c, char* laser_map,
                      char mark_mask);
 
 score_t eval(position_t* p, bool verbose);
+score_t eval_incremental(position_t* p);
+void init_pawn_psq_table();
+void init_incremental_eval(position_t* p);
+void init_coverage_tables();
 
 #endif  // EVAL_H
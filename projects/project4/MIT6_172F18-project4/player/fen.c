@@ -4,6 +4,7 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "./move_gen.h"
 #include "./tbassert.h"
@@ -353,6 +354,7 @@ int fen_to_pos(position_t* p, char* fen) {
   // King check
 
   int Kings[2] = {0, 0};
+  int Pawns = 0;
   for (fil_t f = 0; f < BOARD_WIDTH; ++f) {
     for (rnk_t r = 0; r < BOARD_WIDTH; ++r) {
       square_t sq = square_of(f, r);
@@ -361,10 +363,17 @@ int fen_to_pos(position_t* p, char* fen) {
       if (typ == KING) {
         Kings[color_of(x)]++;
         p->kloc[color_of(x)] = sq;
+      } else if (typ == PAWN) {
+        Pawns++;
       }
     }
   }
 
+  if (Pawns > MAX_PAWNS) {
+    fen_error(fen, c_count, "Too many Pawns");
+    return 1;
+  }
+
   if (Kings[WHITE] == 0) {
     fen_error(fen, c_count, "No White Kings");
     return 1;
@@ -379,6 +388,9 @@ int fen_to_pos(position_t* p, char* fen) {
     return 1;
   }
 
+  init_bitboards(p);
+  init_laser_paths(p);
+
   char c;
   bool done = false;
   // Look for color to move and set ply accordingly
@@ -563,10 +575,12 @@ int pos_to_fen(position_t* p, char* fen) {
 
   // Write the last move, if it exists
   if (p->last_move) {
-    move_to_str(p->last_move, (char*) p + (pos++), 6);
+    fen[pos++] = ' ';
+    move_to_str(p->last_move, fen + pos, MAX_CHARS_IN_MOVE);
+    pos += strlen(fen + pos);
   }
 
-  fen[pos + 6] = '\0';
+  fen[pos] = '\0';
 
-  return pos + 6;
+  return pos;
 }
@@ -8,33 +8,34 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <cilk/cilk.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
 #if PARALLEL
-  #include <cilk/cilk.h>
   #include <cilk/reducer.h>
 #endif
 
+#include "./book.h"
 #include "./eval.h"
 #include "./fen.h"
 #include "./move_gen.h"
 #include "./search.h"
+#include "./tablebase.h"
 #include "./tbassert.h"
+#include "./time_manager.h"
 #include "./tt.h"
 #include "./util.h"
-#include "./lookup.h"
 
 char  VERSION[] = "1038";
 
 #define MAX_HASH 4096       // 4 GB
+#define MAX_THREADS 256
+#define MAX_MULTI_PV 16
 #define INF_TIME 99999999999.0
 #define INF_DEPTH 999       // if user does not specify a depth, use 999
 
-// if the time remain is less than this fraction, dont start the next search iteration
-#define RATIO_FOR_TIMEOUT 0.5
-
 // -----------------------------------------------------------------------------
 // file I/O
 // -----------------------------------------------------------------------------
@@ -53,6 +54,9 @@ extern int USE_NMM;
 extern int FUT_DEPTH;
 extern int TRACE_MOVES;
 extern int DETECT_DRAWS;
+extern int THREADS;
+extern int ASPIRATION_WINDOW;
+extern int PROFILE;
 
 // defined in eval.c
 extern int RANDOMIZE;
@@ -62,13 +66,20 @@ extern int KFACE;
 extern int KAGGRESSIVE;
 extern int MOBILITY;
 extern int LCOVERAGE;
+extern int FAST_COVERAGE;
+extern int INCREMENTAL_EVAL;
+extern int CHECK_EVAL;
 
 // defined in move_gen.c
 extern int USE_KO;
+extern int USE_BITBOARDS;
 
 // defined in tt.c
 extern int USE_TT;
 extern int HASH;
+extern int HASH_PAGES;
+extern int TT_PREFETCH;
+extern int SYM_TT;
 
 // flag that can be set via uci setoption command that will reset the rng to default
 //   seeds. This is useful for running benchmarks for changes that only impact performance.
@@ -98,7 +109,10 @@ static int_options iopts[] = {
   { "pbetween",           &PBETWEEN,   0.025 * PAWN_EV_VALUE,   -PAWN_EV_VALUE, PAWN_EV_VALUE },
   { "pcentral",           &PCENTRAL,   0.05 * PAWN_EV_VALUE,  -PAWN_EV_VALUE, PAWN_EV_VALUE },
   { "lcoverage",         &LCOVERAGE,   0.16 * PAWN_EV_VALUE,   0,              PAWN_EV_VALUE },
+  { "fast_coverage", &FAST_COVERAGE,   1,                     0,              1             },
   { "hash",                   &HASH,   16,                    1,              MAX_HASH   },
+  { "hash_pages",       &HASH_PAGES,   TT_PAGES_TRANSPARENT_HUGE, TT_PAGES_NORMAL, TT_PAGES_EXPLICIT_HUGE },
+  { "threads",             &THREADS,   1,                     1,              MAX_THREADS   },
   { "draw",                   &DRAW,   -0.07 * PAWN_VALUE,    -PAWN_VALUE,    PAWN_VALUE    },
   { "randomize",         &RANDOMIZE,   0,                     0,              PAWN_EV_VALUE },
   { "reset_rng",	 &RESET_RNG,   0,		      0,              1             },
@@ -106,12 +120,19 @@ static int_options iopts[] = {
   { "lmr_r2",               &LMR_R2,   20,                    1,              MAX_NUM_MOVES },
   { "hmb",                     &HMB,   0.03 * PAWN_VALUE,     0,              PAWN_VALUE    },
   { "fut_depth",         &FUT_DEPTH,   3,                     0,              5             },
+  { "aspiration", &ASPIRATION_WINDOW,   0.5 * PAWN_VALUE,      0,              INF           },
   // debug options
   { "use_nmm",             &USE_NMM,   1,                     0,              1             },
   { "detect_draws",   &DETECT_DRAWS,   1,                     0,              1             },
   { "use_tt",               &USE_TT,   1,                     0,              1             },
+  { "tt_prefetch",     &TT_PREFETCH,   1,                     0,              1             },
+  { "sym_tt",               &SYM_TT,   0,                     0,              1             },
   { "use_ko",               &USE_KO,   1,                     0,              1             },
+  { "use_bitboards", &USE_BITBOARDS,   1,                     0,              1             },
   { "trace_moves",     &TRACE_MOVES,   0,                     0,              1             },
+  { "incremental_eval", &INCREMENTAL_EVAL, 1,                0,              1             },
+  { "check_eval",       &CHECK_EVAL,   0,                     0,              1             },
+  { "profile",             &PROFILE,   0,                     0,              1             },
   { "",                        NULL,   0,                     0,              0             }
 };
 
@@ -170,66 +191,66 @@ typedef enum {
 // -----------------------------------------------------------------------------
 
 static move_t bestMoveSoFar;
+static move_t ponderMoveSoFar;  // the reply expected to bestMoveSoFar
 static char theMove[MAX_CHARS_IN_MOVE];
 
 static pthread_mutex_t entry_mutex;
 static uint64_t node_count_serial;
 
+// "go ponder" searches on the opponent's time, in a background thread so
+// that the main thread keeps reading commands.  The position it searches is
+// the one after the ponder move; its clock is set up but does not run until
+// "ponderhit", which turns it into a timed search without restarting it.
+// Any other command ("stop" when the opponent played something else) aborts
+// it first.
+static pthread_t ponder_thread;
+static bool ponder_thread_running;  // main thread only
+static position_t* ponder_position;
+static double ponder_goal;
+static int ponder_multi_pv;
+// Guards pondering and the time manager, which ponderhit updates while the
+// search runs.
+static pthread_mutex_t ponder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ponder_cond = PTHREAD_COND_INITIALIZER;
+static bool pondering;  // waiting for ponderhit or stop
+
 typedef struct {
   position_t* p;
   int depth;
   double tme;
+  int multi_pv;
 } entry_point_args;
 
 typedef struct {
-  char *lookup_best_move;
+  move_t book_move;
 } entry_point_ret;
 
-// Returns the `best_move` if found starting from a 
-// given position `p`. Otherwise returns NULL
-char* try_lookup_table(position_t* p) {
-  char *best_move = NULL;
-
-  move_t moves[OPEN_BOOK_DEPTH] = {0};
-  char move_list[OPEN_BOOK_DEPTH * 10] = {0};
-
-  // Extract history from `p`
-  position_t* current_move = p;
-  for (int move_index = p->ply; move_index > 0; move_index--) {
-    move_t tail = current_move->last_move;
-    moves[move_index - 1] = tail;
-    current_move = current_move->history;
-  }
-
-  // Convert to human readable index. Ie: "move1move2move3"
-  for (int move_index = 0; move_index < p->ply; move_index++) {
-    char hr_move[10];
-    move_to_str(moves[move_index], hr_move, 10);
-    strcat(move_list, hr_move);
-  }
-
-  // Search the table for this index
-  char** table = lookup_tables[p->ply];
-  int table_size = lookup_sizes[p->ply];
-  for (size_t i = 0; i < table_size; i += 2) {
-    if (strcmp(move_list, table[i]) == 0) {
-      best_move = table[i + 1];
-      
-      // wow, such speed, much depth!
-      fprintf(OUT, "info depth +inf move_no 1 time (microsec) 0 nodes +inf nps +inf\n");
-      
-      // This unlock will allow the main thread lock/unlock in
-      // UCIBeginSearch to proceed
-      pthread_mutex_unlock(&entry_mutex);
-      break;
-    }
+// Reports the lines of a multi-PV iteration, best first.
+static void print_multi_pv(int depth, int lines, score_t* scores,
+                           move_t pvs[][MAX_PLY_IN_SEARCH]) {
+  char pvbuf[MAX_PLY_IN_SEARCH * MAX_CHARS_IN_MOVE];
+  for (int k = 0; k < lines; k++) {
+    getPV(pvs[k], pvbuf, sizeof(pvbuf));
+    fprintf(OUT, "info depth %d multipv %d score cp %d pv %s\n", depth, k + 1,
+            scores[k], pvbuf);
+  }
+}
+
+// A ponder search must not end before ponderhit or stop, even if it's mate
+// or a book move.
+static void wait_for_ponder_end() {
+  pthread_mutex_lock(&ponder_mutex);
+  while (pondering) {
+    pthread_cond_wait(&ponder_cond, &ponder_mutex);
   }
-  
-  return best_move;
+  pthread_mutex_unlock(&ponder_mutex);
 }
 
 void entry_point(entry_point_args* args, entry_point_ret* ret) {
-  move_t subpv[MAX_PLY_IN_SEARCH];
+  move_t pvs[MAX_MULTI_PV][MAX_PLY_IN_SEARCH];
+  score_t scores[MAX_MULTI_PV] = {0};
+  rootMoveList root_moves;
+  score_t score = 0;
 
   int depth = args->depth;
   position_t* p = args->p;
@@ -237,47 +258,68 @@ void entry_point(entry_point_args* args, entry_point_ret* ret) {
 
   double et = 0.0;
 
-  // start time of search
-  init_abort_timer(tme);
+  // start time of search, which go ponder has set up for a ponder search
+  if (!ponder_thread_running) {
+    init_abort_timer(tme);
+    tm_start(tme, false);
+  }
 
   init_best_move_history();
+  reset_search_stats();
   tt_age_hashtable();
 
   init_tics();
 
-  // Try using the move lookup table if our ply is less than the depth of the table
-  if (p->ply < OPEN_BOOK_DEPTH) {
-    char *lookup_best_move = try_lookup_table(p);
-    
-    // A best move from the lookup table was found. Return immediately!
-    if (lookup_best_move) {
-      ret->lookup_best_move = lookup_best_move;
-      return;
-    }
+  // Play from the opening book while the position is in it
+  move_t book_move = book_probe(p);
+  if (book_move) {
+    // wow, such speed, much depth!
+    fprintf(OUT, "info depth +inf move_no 1 time (microsec) 0 nodes +inf nps +inf\n");
+    ret->book_move = book_move;
+    wait_for_ponder_end();
+
+    // This unlock will allow the main thread lock/unlock in
+    // UciBeginSearch to proceed
+    pthread_mutex_unlock(&entry_mutex);
+    return;
   }
 
   // Iterative deepening
   for (int d = 1; d <= depth; d++) {
     reset_abort();
+    uint64_t nodes = node_count_serial;
 
     // Unleash wrath!
-    searchRoot(p, -INF, INF, d, 0, subpv, &node_count_serial, OUT);
+    int lines = searchMultiPV(p, scores, args->multi_pv, d, 0, &root_moves,
+                              pvs, &node_count_serial, OUT);
+    score = scores[0];
 
     et = elapsed_time();
-    bestMoveSoFar = subpv[0];
+    bestMoveSoFar = pvs[0][0];
+    ponderMoveSoFar = pvs[0][0] ? pvs[0][1] : 0;
 
     if (!should_abort()) {
-      // print something?
+      if (args->multi_pv > 1) {
+        print_multi_pv(d, lines, scores, pvs);
+      }
     } else {
       break;
     }
 
     // don't start iteration that you cannot complete
-    if (et > tme * RATIO_FOR_TIMEOUT) {
-      break;
+    if (tme < INF_TIME) {
+      pthread_mutex_lock(&ponder_mutex);
+      bool next = tm_next_iteration(d, et, node_count_serial - nodes, score,
+                                    &root_moves);
+      pthread_mutex_unlock(&ponder_mutex);
+      if (!next) {
+        break;
+      }
     }
   }
 
+  wait_for_ponder_end();
+
   // This unlock will allow the main thread lock/unlock in UCIBeginSearch to
   // proceed
   pthread_mutex_unlock(&entry_mutex);
@@ -286,7 +328,7 @@ void entry_point(entry_point_args* args, entry_point_ret* ret) {
 }
 
 // Makes call to entry_point -> make call to searchRoot -> searchRoot in search.c
-void UciBeginSearch(position_t* p, int depth, double tme) {
+void UciBeginSearch(position_t* p, int depth, double tme, int multi_pv) {
   // Setup for the barrier
   pthread_mutex_lock(&entry_mutex);
 
@@ -294,34 +336,442 @@ void UciBeginSearch(position_t* p, int depth, double tme) {
   args.depth = depth;
   args.p = p;
   args.tme = tme;
+  args.multi_pv = multi_pv;
   node_count_serial = 0;
 
   entry_point_ret ret;
 
-  // If non-NULL, means that lookup table was used to determine best move
-  ret.lookup_best_move = NULL;
+  // If nonzero, means that the opening book was used to determine best move
+  ret.book_move = 0;
 
   entry_point(&args, &ret);
 
-  // Check if `entry_point` found a best move using the lookup table
-  if (ret.lookup_best_move) {
-    fprintf(OUT, "bestmove %s\n", ret.lookup_best_move);
+  // Check if `entry_point` found a best move in the opening book
+  if (ret.book_move) {
+    bestMoveSoFar = ret.book_move;
+    ponderMoveSoFar = 0;
+  }
+  char bms[MAX_CHARS_IN_MOVE];
+  move_to_str(bestMoveSoFar, bms, MAX_CHARS_IN_MOVE);
+  snprintf(theMove, MAX_CHARS_IN_MOVE, "%s", bms);
+  if (ponderMoveSoFar) {
+    char pms[MAX_CHARS_IN_MOVE];
+    move_to_str(ponderMoveSoFar, pms, MAX_CHARS_IN_MOVE);
+    fprintf(OUT, "bestmove %s ponder %s\n", bms, pms);
   } else {
-    char bms[MAX_CHARS_IN_MOVE];
-    move_to_str(bestMoveSoFar, bms, MAX_CHARS_IN_MOVE);
-    snprintf(theMove, MAX_CHARS_IN_MOVE, "%s", bms);
     fprintf(OUT, "bestmove %s\n", bms);
   }
 
   return;
 }
 
+static void* ponder_search(void* arg) {
+  UciBeginSearch(ponder_position, INF_DEPTH, ponder_goal, ponder_multi_pv);
+  return NULL;
+}
+
+// Starts searching p on the opponent's time, for goal milliseconds of our own
+// once the opponent plays the ponder move.
+void start_pondering(position_t* p, double goal, int multi_pv) {
+  tbassert(!ponder_thread_running, "Already pondering\n");
+  ponder_position = p;
+  ponder_goal = goal;
+  ponder_multi_pv = multi_pv;
+  pondering = true;
+  init_abort_timer(INF_TIME);
+  tm_start(goal, true);
+  ponder_thread_running = true;
+  if (pthread_create(&ponder_thread, NULL, ponder_search, NULL) != 0) {
+    fprintf(stderr, "Could not start pondering\n");
+    ponder_thread_running = false;
+    pondering = false;
+  }
+}
+
+// The opponent played the ponder move: start the clock.
+void ponder_hit() {
+  pthread_mutex_lock(&ponder_mutex);
+  if (pondering) {
+    pondering = false;
+    restart_abort_timer(ponder_goal);
+    tm_ponderhit(elapsed_time());
+    pthread_cond_signal(&ponder_cond);
+  }
+  pthread_mutex_unlock(&ponder_mutex);
+}
+
+// Aborts the ponder search, converted by ponderhit or not, and waits for it
+// to report its best move, so that the main thread owns the search again.
+void stop_pondering() {
+  if (!ponder_thread_running) {
+    return;
+  }
+  pthread_mutex_lock(&ponder_mutex);
+  pondering = false;
+  restart_abort_timer(0.0);
+  pthread_cond_signal(&ponder_cond);
+  pthread_mutex_unlock(&ponder_mutex);
+  pthread_join(ponder_thread, NULL);
+  ponder_thread_running = false;
+}
+
+// Searches p to a fixed depth with 1, 2, 4, ... and finally THREADS workers,
+// clearing the hash table before each run, and reports the speedup of each
+// over the single-worker run.
+void do_speedup(position_t* p, int depth) {
+  int threads = THREADS;
+  double serial_time = 0.0;
+
+  for (int n = 1; ; n = (2 * n < threads) ? 2 * n : threads) {
+    THREADS = n;
+    init_search_threads(n);
+    tt_clear_hashtable();
+
+    double start = milliseconds();
+    UciBeginSearch(p, depth, INF_TIME, 1);
+    double et = milliseconds() - start;
+    if (et < 0.001) {
+      et = 0.001;  // hack so that we don't divide by 0
+    }
+    if (n == 1) {
+      serial_time = et;
+    }
+
+    fprintf(OUT, "info string threads %d time (ms) %d nodes %" PRIu64
+            " nps %" PRIu64 " speedup %.2f\n", n, (int) et, node_count_serial,
+            (uint64_t) (1000 * node_count_serial / et), serial_time / et);
+
+    if (n == threads) {
+      break;
+    }
+  }
+
+  THREADS = threads;
+  init_search_threads(threads);
+}
+
+void print_hash_info() {
+  size_t bytes = tt_get_num_of_records() * tt_get_bytes_per_record();
+  printf("info string Hash table set to %d records of %zu bytes each\n",
+         tt_get_num_of_records(), tt_get_bytes_per_record());
+  printf("info string Total hash table size: %zu bytes\n", bytes);
+  printf("info string Hash table pages: %zu %s pages of %zu bytes\n",
+         (bytes + tt_get_page_size() - 1) / tt_get_page_size(),
+         tt_get_page_mode(), tt_get_page_size());
+}
+
+// Searches p to a fixed depth twice, with tt_prefetch off and then on,
+// clearing the hash table before each run, and reports the average latency
+// of a hash table probe in each.
+void do_ttbench(position_t* p, int depth) {
+  int prefetch = TT_PREFETCH;
+
+  for (int on = 0; on <= 1; on++) {
+    TT_PREFETCH = on;
+    tt_clear_hashtable();
+    tt_reset_probe_timing(true);
+
+    double start = milliseconds();
+    UciBeginSearch(p, depth, INF_TIME, 1);
+    double et = milliseconds() - start;
+
+    uint64_t probes;
+    uint64_t cycles;
+    tt_get_probe_timing(&probes, &cycles);
+    fprintf(OUT, "info string tt_prefetch %d time (ms) %d nodes %" PRIu64
+            " probes %" PRIu64 " cycles/probe %.1f\n", on, (int) et,
+            node_count_serial, probes, probes ? (double) cycles / probes : 0.0);
+  }
+
+  tt_reset_probe_timing(false);
+  TT_PREFETCH = prefetch;
+}
+
+// Measures the cost of the position layout: searches p to a fixed depth with a
+// single worker and the hash table cleared, reporting the nodes per second and,
+// where the hardware counters can be read, the cache misses per node.  Then
+// times making each move of p by copying the position and in place.
+void do_posbench(position_t* p, int depth) {
+  int threads = THREADS;
+  THREADS = 1;
+  init_search_threads(1);
+  tt_clear_hashtable();
+
+  fprintf(OUT, "info string position_t %zu bytes undo_t %zu bytes\n",
+          sizeof(position_t), sizeof(undo_t));
+
+  int counter = cache_miss_counter_start();
+  double start = milliseconds();
+  UciBeginSearch(p, depth, INF_TIME, 1);
+  double et = milliseconds() - start;
+  int64_t misses = cache_miss_counter_stop(counter);
+  if (et < 0.001) {
+    et = 0.001;  // hack so that we don't divide by 0
+  }
+
+  fprintf(OUT, "info string depth %d time (ms) %d nodes %" PRIu64
+          " nps %" PRIu64, depth, (int) et, node_count_serial,
+          (uint64_t) (1000 * node_count_serial / et));
+  if (misses >= 0 && node_count_serial > 0) {
+    fprintf(OUT, " cache-misses/node %.2f\n",
+            (double) misses / node_count_serial);
+  } else {
+    fprintf(OUT, " cache-misses/node n/a\n");
+  }
+
+  THREADS = threads;
+  init_search_threads(threads);
+
+  sortable_move_t moves[MAX_NUM_MOVES];
+  int num_moves = generate_all(p, moves, true);
+  const int reps = 20000;
+  position_t np;
+  undo_t u;
+
+  start = milliseconds();
+  for (int r = 0; r < reps; r++) {
+    for (int i = 0; i < num_moves; i++) {
+      low_level_make_move(p, &np, get_move(moves[i]));
+    }
+  }
+  double copy_ms = milliseconds() - start;
+
+  start = milliseconds();
+  for (int r = 0; r < reps; r++) {
+    for (int i = 0; i < num_moves; i++) {
+      low_level_make_move_in_place(p, get_move(moves[i]), &u);
+      unmake_move(p, &u);
+    }
+  }
+  double in_place_ms = milliseconds() - start;
+
+  double made = (double) reps * (num_moves > 0 ? num_moves : 1);
+  fprintf(OUT, "info string moves %d copy make (ns) %.1f"
+          " make in place + unmake (ns) %.1f\n", num_moves,
+          1e6 * copy_ms / made, 1e6 * in_place_ms / made);
+}
+
+// Positions searched by the bench command, taken from a game at intervals
+// from the end of the opening to the endgame, with both sides to move.  None
+// of them are in the built-in book.
+static const char* bench_fens[] = {
+  "ss3nw3/4se3/2nwse2SW1/2se5/1nenw2NWSE1/2NW1NWSE2/4SE3/7NN W b4c3",
+  "ss4nw2/4se3/2nwse2SW1/NWse1ne1SE2/5NW2/2ne1NWSE2/4SE3/7NN B c2b3a4",
+  "ss4nw2/5se2/ne1nwse2SW1/2ne2SE2/4NENW2/4NWSE2/1ne2SE2NN/8 W e6f6",
+  "ss5se1/5SE2/ne1nwse2seSW/8/2ne1NENW2/4NWSE2/1ne2SE2NN/8 B g7f7f6",
+  "ss3se3/4seSESW1/ne1nw5/7se/2ne1NENW2/4NWSE2/1ne2SE2NN/8 W g5h4",
+  "ss2se4/5SESWNE/ne1sw5/4NWse1se/8/1ne1NW1SE2/1ne2SE2NN/8 B f3e4",
+  "ss2se1sw2/5SW1NE/ne1sw5/6se1/4NW2SE/1ne1NW1SE2/1ne2SE2NN/8 W f6g6f7",
+  "ss2se1sw2/5SW1NE/ne1sw5/6sw1/4NW1SE1/1ne1NWSESENN1/2ne5/8 B g4h3g3",
+};
+#define NUM_BENCH_FENS ((int) (sizeof(bench_fens) / sizeof(bench_fens[0])))
+
+// Searches each of the bench positions to a fixed depth with a single worker,
+// starting from a cleared hash table, no killers and a reset random number
+// generator, so that the search does exactly the same work every time.  The
+// total node count is then a signature of the search: a change that only
+// makes the player faster must leave it alone.
+void do_bench(int depth) {
+  static position_t p __attribute__((aligned(64)));
+  int threads = THREADS;
+  THREADS = 1;
+  init_search_threads(1);
+
+  uint64_t nodes = 0;
+  double time = 0.0;
+  for (int i = 0; i < NUM_BENCH_FENS; i++) {
+    if (fen_to_pos(&p, (char*) bench_fens[i]) != 0) {
+      fprintf(OUT, "info string bench position %d is not a valid FEN\n", i + 1);
+      continue;
+    }
+    tt_clear_hashtable();
+    init_killers();
+    RESET_RNG = 1;
+
+    double start = milliseconds();
+    UciBeginSearch(&p, depth, INF_TIME, 1);
+    double et = milliseconds() - start;
+
+    fprintf(OUT, "info string bench position %d nodes %" PRIu64
+            " time (ms) %d\n", i + 1, node_count_serial, (int) et);
+    nodes += node_count_serial;
+    time += et;
+  }
+  if (time < 0.001) {
+    time = 0.001;  // hack so that we don't divide by 0
+  }
+
+  fprintf(OUT, "info string bench depth %d positions %d nodes %" PRIu64
+          " time (ms) %d nps %" PRIu64 "\n", depth, NUM_BENCH_FENS, nodes,
+          (int) time, (uint64_t) (1000 * nodes / time));
+
+  THREADS = threads;
+  init_search_threads(threads);
+}
+
+// analyze reads and searches this many positions at a time
+#define ANALYZE_BATCH 256
+
+typedef struct {
+  char    fen[MAX_FEN_CHARS];
+  int     lines;
+  score_t scores[MAX_MULTI_PV];
+  move_t  pvs[MAX_MULTI_PV][MAX_PLY_IN_SEARCH];
+} analysis_t;
+
+// Searches p to depth with multi_pv lines, the way entry_point does but
+// without the clock, the book or any output, so that several positions can
+// be searched at once.
+static void analyze_position(position_t* p, int depth, int multi_pv,
+                             analysis_t* a, FILE* quiet) {
+  rootMoveList root_moves;
+  uint64_t nodes = 0;
+  memset(a->scores, 0, sizeof(a->scores));
+  a->pvs[0][0] = 0;
+  a->lines = 0;
+  for (int d = 1; d <= depth; d++) {
+    a->lines = searchMultiPV(p, a->scores, multi_pv, d, 0, &root_moves,
+                             a->pvs, &nodes, quiet);
+  }
+}
+
+// Writes s as a JSON string.
+static void print_json_string(FILE* out, const char* s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', out);
+    }
+    if ((unsigned char) *s >= ' ') {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void print_analysis(FILE* out, analysis_t* a, int depth) {
+  char buf[MAX_PLY_IN_SEARCH * MAX_CHARS_IN_MOVE];
+  fprintf(out, "{\"fen\": ");
+  print_json_string(out, a->fen);
+  fprintf(out, ", \"depth\": %d, \"lines\": [", depth);
+  for (int k = 0; k < a->lines && a->pvs[k][0] != 0; k++) {
+    move_to_str(a->pvs[k][0], buf, MAX_CHARS_IN_MOVE);
+    fprintf(out, "%s{\"move\": \"%s\", \"score\": %d, ", k ? ", " : "", buf,
+            a->scores[k]);
+    getPV(a->pvs[k], buf, sizeof(buf));
+    fprintf(out, "\"pv\": \"%s\"}", buf);
+  }
+  fprintf(out, "]}\n");
+}
+
+// Searches every FEN of in_file, one per line, to depth with multi_pv lines,
+// and writes the results to out_file as JSON lines in the same order.  The
+// positions are searched at the same time, one per worker, each serially and
+// all with the same hash table; a position takes about as long as it would
+// alone, and they are done THREADS at a time.
+void do_analyze(char* in_file, char* out_file, int depth, int multi_pv) {
+  FILE* in = fopen(in_file, "r");
+  if (in == NULL) {
+    fprintf(OUT, "info string Cannot read %s\n", in_file);
+    return;
+  }
+  FILE* out = fopen(out_file, "w");
+  FILE* quiet = fopen("/dev/null", "w");
+  position_t* ps;
+  analysis_t* as = malloc(sizeof(analysis_t) * ANALYZE_BATCH);
+  if (out == NULL || quiet == NULL || as == NULL ||
+      posix_memalign((void**) &ps, __alignof__(position_t),
+                     sizeof(position_t) * ANALYZE_BATCH) != 0) {
+    fprintf(OUT, "info string Cannot write %s\n", out_file);
+    fclose(in);
+    if (out != NULL) {
+      fclose(out);
+    }
+    if (quiet != NULL) {
+      fclose(quiet);
+    }
+    free(as);
+    return;
+  }
+
+  // The workers all search, but none splits its search
+  int threads = THREADS;
+  THREADS = 1;
+  init_abort_timer(INF_TIME);
+  reset_abort();
+  init_best_move_history();
+  reset_search_stats();
+  tt_age_hashtable();
+
+  double start = milliseconds();
+  int total = 0;
+  char line[MAX_FEN_CHARS];
+  bool more = true;
+  while (more) {
+    int count = 0;
+    while (count < ANALYZE_BATCH && (more = fgets(line, sizeof(line), in))) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0' || line[0] == '#') {
+        continue;
+      }
+      if (fen_to_pos(&ps[count], line) != 0) {
+        fprintf(OUT, "info string Skipping invalid FEN %s\n", line);
+        continue;
+      }
+      snprintf(as[count].fen, MAX_FEN_CHARS, "%s", line);
+      count++;
+    }
+
+    cilk_for (int i = 0; i < count; i++) {
+      analyze_position(&ps[i], depth, multi_pv, &as[i], quiet);
+    }
+
+    for (int i = 0; i < count; i++) {
+      print_analysis(out, &as[i], depth);
+    }
+    total += count;
+  }
+
+  fprintf(OUT, "info string analyze depth %d positions %d time (ms) %d\n",
+          depth, total, (int) (milliseconds() - start));
+
+  THREADS = threads;
+  fclose(in);
+  fclose(out);
+  fclose(quiet);
+  free(as);
+  free(ps);
+}
+
 // -----------------------------------------------------------------------------
 // argparse help
 // -----------------------------------------------------------------------------
 
 // print help messages in uci
 void help()  {
+  printf("analyze   - Search every position of a file of FENs, one per line, to a\n");
+  printf("            fixed depth (default 6) with a number of lines (default 1),\n");
+  printf("            and write the moves, scores and principal variations as\n");
+  printf("            JSON lines.  The positions are searched at the same time,\n");
+  printf("            one per worker, sharing the hash table.\n");
+  printf("            Sample usage: \n");
+  printf("                analyze openings.fen openings.jsonl 8 3: the 3 best moves\n");
+  printf("                    of each position of openings.fen at depth 8\n");
+  printf("bench     - Search a built-in set of positions to a fixed depth (default\n");
+  printf("            4) with one worker and a cleared hash table, and report the\n");
+  printf("            total node count and the nodes per second.  The node count\n");
+  printf("            must not change unless the search itself does.\n");
+  printf("            Sample usage: \n");
+  printf("                bench 5: measure at depth 5\n");
+  printf("book      - Build an opening book from game records, load one, or look up\n");
+  printf("            the current position.  Without a book file, the engine plays\n");
+  printf("            from a few built-in lines.  The book is keyed by position, so\n");
+  printf("            it also finds positions reached by other move orders.\n");
+  printf("            Sample usage: \n");
+  printf("                book build 20 my.book book.dta games.pgn: build my.book from\n");
+  printf("                    the first 20 plies of each game in book.dta and games.pgn\n");
+  printf("                book load my.book: play from my.book\n");
+  printf("                book probe: show the book move of the current position\n");
   printf("eval      - Evaluate current position.\n");
   printf("display   - Display current board state.\n");
   printf("generate  - Generate all possible moves.\n");
@@ -330,9 +780,16 @@ void help()  {
   printf("            time <time_limit>: search assume you have <time> amount of time\n");
   printf("                               for the whole game.\n");
   printf("            inc <time_inc>:    set the fischer time increment for the search\n");
+  printf("            multipv <n>:       report the <n> best moves with their scores\n");
+  printf("                               and principal variations\n");
+  printf("            ponder:            search on the opponent's time the position\n");
+  printf("                               after the move it is expected to play, until\n");
+  printf("                               \"ponderhit\" or \"stop\"\n");
   printf("            Both time arguments are specified in milliseconds.\n");
   printf("            Sample usage: \n");
   printf("                go depth 4: search until depth 4\n");
+  printf("                go ponder time 60000 inc 500: ponder with 60 s and 0.5 s\n");
+  printf("                    increment left for the search after ponderhit\n");
   printf("help      - Display help (this info).\n");
   printf("isready   - Ask if the UCI engine is ready, if so it echoes \"readyok\".\n");
   printf("            This is mainly used to synchronize the engine with the GUI.\n");
@@ -343,6 +800,19 @@ void help()  {
   printf("            Used to verify move the generator.\n");
   printf("            Sample usage: \n");
   printf("                depth 3: generate all possible moves for depth 1--3\n");
+  printf("                perft 3 check: also cross-check the bitboard and mailbox\n");
+  printf("                               move generators at every node\n");
+  printf("                perft 6 hash 256: look up repeated subtrees in a 256 MB\n");
+  printf("                                  perft hash table\n");
+  printf("                perft 5 divide: also show the count of each first move\n");
+  printf("ponderhit - The opponent played the move pondered on: go on with the ponder\n");
+  printf("            search as a timed search.\n");
+  printf("posbench  - Search the current position to a fixed depth (default 6) with\n");
+  printf("            one worker and report the nodes per second and the cache\n");
+  printf("            misses per node, then time making each move of the position\n");
+  printf("            by copying it and in place.\n");
+  printf("            Sample usage: \n");
+  printf("                posbench 7: measure at depth 7\n");
   printf("position  - Set up the board using the fenstring given.  Possible arguments are:\n");
   printf("            startpos:     set up the board with default starting position.\n");
   printf("            endgame:      set up the board with endgame configuration.\n");
@@ -356,6 +826,38 @@ void help()  {
   printf("            Use the comment \"uci\" to see possible options and their current values\n");
   printf("            Sample usage: \n");
   printf("                setoption name fut_depth value 4: set fut_depth to 4\n");
+  printf("speedup   - Search the current position to a fixed depth (default 6) with\n");
+  printf("            1, 2, 4, ... up to <threads> workers and report the speedup\n");
+  printf("            of each run over the single-worker one.\n");
+  printf("            Sample usage: \n");
+  printf("                speedup 7: compare the workers at depth 7\n");
+  printf("stats     - Display statistics of the last search: the share of quiescence\n");
+  printf("            nodes and the zaps they search, the branching factor, hash\n");
+  printf("            table hits, stores and collisions, which moves cut off, how\n");
+  printf("            often each pruning applied, how often the hash move, the\n");
+  printf("            killers, or the generated moves cut off, and how often the\n");
+  printf("            search locks were contended.  With the profile option set\n");
+  printf("            to 1, it also shows the time spent in eval, move generation\n");
+  printf("            and make_move.\n");
+  printf("stop      - Stop pondering and report the best move found so far.\n");
+  printf("tb        - Build endgame tablebases for up to %d Pawns, load them, or look\n",
+         TB_MAX_PAWNS);
+  printf("            up the current position.  Once loaded, the search scores the\n");
+  printf("            positions they win or lose from the tables.\n");
+  printf("            Sample usage: \n");
+  printf("                tb gen 1 leiserchess.tb: build the tables for up to 1 Pawn\n");
+  printf("                tb load leiserchess.tb: use the tables in leiserchess.tb\n");
+  printf("                tb probe: show the table value of the current position\n");
+  printf("tt        - Save the hash table to a file, or load it back.\n");
+  printf("            The file must match the hash size in use.\n");
+  printf("            Sample usage: \n");
+  printf("                tt save warm.tt: write the hash table to warm.tt\n");
+  printf("                tt load warm.tt: replace the hash table with warm.tt\n");
+  printf("ttbench   - Search the current position to a fixed depth (default 6) with\n");
+  printf("            tt_prefetch off and on, and report the average number of\n");
+  printf("            cycles a hash table probe takes in each.\n");
+  printf("            Sample usage: \n");
+  printf("                ttbench 7: compare the probes at depth 7\n");
   printf("uci       - Display UCI version and options\n");
   printf("\n");
 }
@@ -473,7 +975,13 @@ void print_options() {
 // -----------------------------------------------------------------------------
 
 int main(int argc, char* argv[]) {
-  position_t* gme = (position_t*) malloc(sizeof(position_t) * MAX_PLY_IN_GAME);
+  // position_t is cache line aligned, which malloc does not guarantee
+  position_t* gme;
+  if (posix_memalign((void**) &gme, __alignof__(position_t),
+                     sizeof(position_t) * MAX_PLY_IN_GAME) != 0) {
+    fprintf(stderr, "Out of memory for the game\n");
+    return 1;
+  }
 
   setbuf(stdout, NULL);
   setbuf(stdin, NULL);
@@ -488,6 +996,10 @@ int main(int argc, char* argv[]) {
 
   init_options();
   init_zob();
+  init_coverage_tables();
+  init_pawn_psq_table();
+  book_load_builtin();
+  init_search_threads(THREADS);
 
   char** tok = (char**) malloc(sizeof(char*) * MAX_CHARS_IN_TOKEN * MAX_PLY_IN_GAME);
   int   ix = 0;  // index of which position we are operating on
@@ -498,6 +1010,7 @@ int main(int argc, char* argv[]) {
 
 
   tt_make_hashtable(HASH);   // initial hash table
+  print_hash_info();
   fen_to_pos(&gme[ix], "");  // initialize with an actual position
 
   //  Check to make sure we don't loop infinitely if we don't get input.
@@ -520,6 +1033,18 @@ int main(int argc, char* argv[]) {
         saw_input = true;
       }
 
+      // Only these leave a ponder search running
+      if (strcmp(tok[0], "ponderhit") == 0) {
+        ponder_hit();
+        continue;
+      }
+      if (strcmp(tok[0], "isready") != 0) {
+        stop_pondering();
+      }
+      if (strcmp(tok[0], "stop") == 0) {
+        continue;
+      }
+
       if (strcmp(tok[0], "quit") == 0) {
         break;
       }
@@ -670,18 +1195,19 @@ int main(int argc, char* argv[]) {
               printf("info setting %s to %d\n", iopts[j].name, v);
               *(iopts[j].var) = v;
 
-              if (strcmp(name + 1, "hash") == 0) {
+              if (strcmp(name + 1, "hash") == 0 ||
+                  strcmp(name + 1, "hash_pages") == 0) {
                 tt_resize_hashtable(HASH);
-                printf("info string Hash table set to %d records of "
-                       "%zu bytes each\n",
-                       tt_get_num_of_records(), tt_get_bytes_per_record());
-                printf("info string Total hash table size: %zu bytes\n",
-                       tt_get_num_of_records() * tt_get_bytes_per_record());
+                print_hash_info();
+              }
+              if (strcmp(name + 1, "threads") == 0) {
+                init_search_threads(THREADS);
+              }
+              if (strcmp(name + 1, "pcentral") == 0) {
+                init_pawn_psq_table();
               }
               if (strcmp(name + 1, "reset_rng") == 0) {
                 printf("info string reset the rng\n");
-                // if setting the random seed we need to reinit the zob
-                init_zob();
               }
               break;
             }
@@ -737,9 +1263,25 @@ int main(int argc, char* argv[]) {
         double inc = 0.0;
         int    depth = INF_DEPTH;
         double goal = INF_TIME;
+        bool   ponder = false;
+        int    multi_pv = 1;
 
         // process various tokens here
         for (int n = 1; n < token_count; n++) {
+          if (strcmp(tok[n], "ponder") == 0) {
+            ponder = true;
+            continue;
+          }
+          if (strcmp(tok[n], "multipv") == 0) {
+            n++;
+            multi_pv = strtol(tok[n], (char**)NULL, 10);
+            if (multi_pv < 1) {
+              multi_pv = 1;
+            } else if (multi_pv > MAX_MULTI_PV) {
+              multi_pv = MAX_MULTI_PV;
+            }
+            continue;
+          }
           if (strcmp(tok[n], "depth") == 0) {
             n++;
             depth = strtol(tok[n], (char**)NULL, 10);
@@ -758,19 +1300,145 @@ int main(int argc, char* argv[]) {
         }
 
         if (depth < INF_DEPTH) {
-          UciBeginSearch(&gme[ix], depth, INF_TIME);
+          UciBeginSearch(&gme[ix], depth, INF_TIME, multi_pv);
+        } else if (ponder) {
+          start_pondering(&gme[ix], tm_goal(tme, inc), multi_pv);
+        } else {
+          goal = tm_goal(tme, inc);
+          UciBeginSearch(&gme[ix], INF_DEPTH, goal, multi_pv);
+        }
+        continue;
+      }
+
+      if (strcmp(tok[0], "stats") == 0) {  // Statistics of the last search
+        print_search_stats(OUT);
+        continue;
+      }
+
+      if (strcmp(tok[0], "book") == 0) {  // Opening book
+        if (token_count >= 5 && strcmp(tok[1], "build") == 0) {
+          if (book_build(tok[3], strtol(tok[2], (char**)NULL, 10), tok + 4,
+                         token_count - 4)) {
+            fprintf(OUT, "info string built %"PRIu64" book records into %s\n",
+                    book_num_records(), tok[3]);
+          }
+        } else if (token_count >= 3 && strcmp(tok[1], "load") == 0) {
+          if (book_load(tok[2])) {
+            fprintf(OUT, "info string loaded %"PRIu64" book records from %s\n",
+                    book_num_records(), tok[2]);
+          }
+        } else if (token_count >= 2 && strcmp(tok[1], "probe") == 0) {
+          move_t mv = book_probe(&gme[ix]);
+          char buf[MAX_CHARS_IN_MOVE];
+          move_to_str(mv, buf, MAX_CHARS_IN_MOVE);
+          fprintf(OUT, "info string book move %s\n", mv ? buf : "none");
         } else {
-          goal = tme * 0.02;   // use about 1/50 of main time
-          goal += inc * 0.80;  // use most of increment
-          // sanity check,  make sure that we don't run ourselves too low
-          if (goal * 10 > tme) {
-            goal = tme / 10.0;
+          printf("Usage: book build <plies> <file> <games>..., book load <file>, "
+                 "or book probe\n");
+        }
+        continue;
+      }
+
+      if (strcmp(tok[0], "tb") == 0) {  // Endgame tablebases
+        int result, distance;
+        if (token_count >= 4 && strcmp(tok[1], "gen") == 0) {
+          tb_generate(strtol(tok[2], (char**)NULL, 10), tok[3]);
+        } else if (token_count >= 3 && strcmp(tok[1], "load") == 0) {
+          if (tb_load(tok[2])) {
+            fprintf(OUT, "info string loaded tablebases from %s\n", tok[2]);
+          }
+        } else if (token_count >= 2 && strcmp(tok[1], "probe") == 0) {
+          if (!tb_probe(&gme[ix], &result, &distance)) {
+            fprintf(OUT, "info string not in the tablebases\n");
+          } else if (result == 0) {
+            fprintf(OUT, "info string draw\n");
+          } else {
+            fprintf(OUT, "info string side to move %s in %d plies\n",
+                    result > 0 ? "wins" : "loses", distance);
           }
-          UciBeginSearch(&gme[ix], INF_DEPTH, goal);
+        } else {
+          printf("Usage: tb gen <pawns> <file>, tb load <file>, or tb probe\n");
         }
         continue;
       }
 
+      if (strcmp(tok[0], "tt") == 0) {  // Save or load the hash table
+        if (token_count < 3) {
+          printf("Usage: tt save <file> or tt load <file>\n");
+        } else if (strcmp(tok[1], "save") == 0) {
+          if (tt_save_hashtable(tok[2])) {
+            fprintf(OUT, "info string saved %d hash table records to %s\n",
+                    tt_get_num_of_records(), tok[2]);
+          }
+        } else if (strcmp(tok[1], "load") == 0) {
+          if (tt_load_hashtable(tok[2])) {
+            fprintf(OUT, "info string loaded %d hash table records from %s\n",
+                    tt_get_num_of_records(), tok[2]);
+          }
+        } else {
+          printf("Usage: tt save <file> or tt load <file>\n");
+        }
+        continue;
+      }
+
+      if (strcmp(tok[0], "analyze") == 0) {  // Search many positions
+        if (token_count < 3) {
+          fprintf(OUT, "Usage: analyze <fen file> <result file> [depth [multipv]]\n");
+          continue;
+        }
+        int depth = 6;
+        int multi_pv = 1;
+        if (token_count >= 4) {
+          depth = strtol(tok[3], (char**)NULL, 10);
+        }
+        if (token_count >= 5) {
+          multi_pv = strtol(tok[4], (char**)NULL, 10);
+          if (multi_pv < 1) {
+            multi_pv = 1;
+          } else if (multi_pv > MAX_MULTI_PV) {
+            multi_pv = MAX_MULTI_PV;
+          }
+        }
+        do_analyze(tok[1], tok[2], depth, multi_pv);
+        continue;
+      }
+
+      if (strcmp(tok[0], "bench") == 0) {  // Measure search speed
+        int depth = 4;
+        if (token_count >= 2) {
+          depth = strtol(tok[1], (char**)NULL, 10);
+        }
+        do_bench(depth);
+        continue;
+      }
+
+      if (strcmp(tok[0], "ttbench") == 0) {  // Measure hash probe latency
+        int depth = 6;
+        if (token_count >= 2) {
+          depth = strtol(tok[1], (char**)NULL, 10);
+        }
+        do_ttbench(&gme[ix], depth);
+        continue;
+      }
+
+      if (strcmp(tok[0], "posbench") == 0) {  // Measure the position layout
+        int depth = 6;
+        if (token_count >= 2) {
+          depth = strtol(tok[1], (char**)NULL, 10);
+        }
+        do_posbench(&gme[ix], depth);
+        continue;
+      }
+
+      if (strcmp(tok[0], "speedup") == 0) {  // Measure parallel scaling
+        int depth = 6;
+        if (token_count >= 2) {
+          depth = strtol(tok[1], (char**)NULL, 10);
+        }
+        do_speedup(&gme[ix], depth);
+        continue;
+      }
+
       if (strcmp(tok[0], "perft") == 0) {  // Test move generator
         // Correct output to depth 4
         // perft  1 61
@@ -783,7 +1451,19 @@ int main(int argc, char* argv[]) {
         if (token_count >= 2) {  // Takes a depth argument to test deeper
           depth = strtol(tok[1], (char**)NULL, 10);
         }
-        do_perft(gme, depth, 0);
+        bool cross_check = false;
+        bool divide = false;
+        int hash_mb = 0;
+        for (int j = 2; j < token_count; j++) {
+          if (strcmp(tok[j], "check") == 0) {
+            cross_check = true;
+          } else if (strcmp(tok[j], "divide") == 0) {
+            divide = true;
+          } else if (strcmp(tok[j], "hash") == 0 && j + 1 < token_count) {
+            hash_mb = strtol(tok[++j], (char**)NULL, 10);
+          }
+        }
+        do_perft(gme, depth, 0, cross_check, divide, hash_mb);
         continue;
       }
 
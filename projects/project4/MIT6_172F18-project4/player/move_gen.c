@@ -5,10 +5,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
+#include <cilk/cilk.h>
+
 #include "./eval.h"
 #include "./fen.h"
 #include "./search.h"
@@ -19,6 +22,7 @@
 #define MIN(x, y)  ((x) < (y) ? (x) : (y))
 
 int USE_KO;  // Respect the Ko rule
+int USE_BITBOARDS;  // Generate moves from the bitboards instead of the mailbox
 
 static char* color_strs[2] = {"White", "Black"};
 
@@ -107,7 +111,20 @@ char* nesw_to_str[NUM_ORI] = {"north", "east", "south", "west"};
 // node counts.
 static uint64_t   zob[ARR_SIZE][1 << PIECE_SIZE];
 static uint64_t   zob_color;
-uint64_t myrand();
+
+static void init_symmetries();
+
+// The keys come from a fixed seed rather than from myrand(), so that they are
+// the same in every run and files keyed by them, such as opening books, can
+// be built once and used from then on.
+//
+// http://xoshiro.di.unimi.it/splitmix64.c
+static uint64_t zob_rand(uint64_t* state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
 
 uint64_t compute_zob_key(position_t* p) {
   uint64_t key = 0;
@@ -124,13 +141,41 @@ uint64_t compute_zob_key(position_t* p) {
   return key;
 }
 
+// The keys are drawn square by square in the order of the 16x16 array that
+// held the board before, and those of squares off the board are dropped, so
+// the keys did not change when the array shrank.  Fixed-depth searches thus
+// still visit the same nodes as before, which keeps benchmarks comparable.
+#define ZOB_LEGACY_WIDTH 16
+#define ZOB_LEGACY_ORIGIN ((ZOB_LEGACY_WIDTH - BOARD_WIDTH) / 2)
+
 void init_zob() {
+  uint64_t state = 0x6172;
+  memset(zob, 0, sizeof(zob));
+  for (int i = 0; i < ZOB_LEGACY_WIDTH * ZOB_LEGACY_WIDTH; i++) {
+    fil_t f = i / ZOB_LEGACY_WIDTH - ZOB_LEGACY_ORIGIN;
+    rnk_t r = i % ZOB_LEGACY_WIDTH - ZOB_LEGACY_ORIGIN;
+    bool on_board = f >= 0 && f < BOARD_WIDTH && r >= 0 && r < BOARD_WIDTH;
+    for (int j = 0; j < (1 << PIECE_SIZE); j++) {
+      uint64_t key = zob_rand(&state);
+      if (on_board) {
+        zob[square_of(f, r)][j] = key;
+      }
+    }
+  }
+  zob_color = zob_rand(&state);
+  init_symmetries();
+}
+
+// A fingerprint of the Zobrist keys, so that data keyed by them (such as a
+// saved transposition table) can be checked against the keys in use.
+uint64_t zob_fingerprint() {
+  uint64_t h = zob_color;
   for (int i = 0; i < ARR_SIZE; i++) {
     for (int j = 0; j < (1 << PIECE_SIZE); j++) {
-      zob[i][j] = myrand();
+      h = (h << 7 | h >> 57) ^ zob[i][j];
     }
   }
-  zob_color = myrand();
+  return h;
 }
 
 // -----------------------------------------------------------------------------
@@ -147,14 +192,14 @@ square_t square_of(fil_t f, rnk_t r) {
 
 // Finds file of square
 fil_t fil_of(square_t sq) {
-  fil_t f = ((sq >> FIL_SHIFT) & FIL_MASK) - FIL_ORIGIN;
+  fil_t f = sq / ARR_WIDTH - FIL_ORIGIN;
   DEBUG_LOG(1, "File of square %d is %d\n", sq, f);
   return f;
 }
 
 // Finds rank of square
 rnk_t rnk_of(square_t sq) {
-  rnk_t r = ((sq >> RNK_SHIFT) & RNK_MASK) - RNK_ORIGIN;
+  rnk_t r = sq % ARR_WIDTH - RNK_ORIGIN;
   DEBUG_LOG(1, "Rank of square %d is %d\n", sq, r);
   return r;
 }
@@ -170,6 +215,82 @@ int square_to_str(square_t sq, char* buf, size_t bufsize) {
   }
 }
 
+// -----------------------------------------------------------------------------
+// Bitboards
+// -----------------------------------------------------------------------------
+
+static int bb_index_of(square_t sq) {
+  return BOARD_WIDTH * fil_of(sq) + rnk_of(sq);
+}
+
+bitboard_t bb_of_square(square_t sq) {
+  tbassert(fil_of(sq) >= 0 && fil_of(sq) < BOARD_WIDTH &&
+           rnk_of(sq) >= 0 && rnk_of(sq) < BOARD_WIDTH, "sq: %d\n", sq);
+  return 1ULL << bb_index_of(sq);
+}
+
+square_t square_of_bb_index(int i) {
+  tbassert(i >= 0 && i < BB_SIZE, "i: %d\n", i);
+  return square_of(i / BOARD_WIDTH, i % BOARD_WIDTH);
+}
+
+// The (up to) 8 squares adjacent to the squares in b, excluding b itself.
+bitboard_t bb_neighbors(bitboard_t b) {
+  bitboard_t x = b | ((b << 1) & ~BB_RANK_FIRST) | ((b >> 1) & ~BB_RANK_LAST);
+  x |= (x << BOARD_WIDTH) | (x >> BOARD_WIDTH);
+  return x & ~b;
+}
+
+// Adds x to (or removes x from) the bitboards at square sq.  Like the Zobrist
+// key, this is an involution, so make_move applies it once for the piece that
+// leaves a square and once for the piece that arrives.  The running Pawn
+// evaluation sums follow along.
+static void bb_toggle(position_t* p, square_t sq, piece_t x) {
+  ptype_t typ = ptype_of(x);
+  if (typ != PAWN && typ != KING) {
+    return;
+  }
+  int i = bb_index_of(sq);
+  bitboard_t b = 1ULL << i;
+  int ori = ori_of(x);
+  if (typ == PAWN) {
+    if (p->bb_pieces[color_of(x)][PAWN - PAWN] & b) {
+      p->psq_score[color_of(x)] -= pawn_psq_table[i];
+    } else {
+      p->psq_score[color_of(x)] += pawn_psq_table[i];
+    }
+  }
+  p->bb_pieces[color_of(x)][typ - PAWN] ^= b;
+  if (ori & 1) {
+    p->bb_ori[0] ^= b;
+  }
+  if (ori & 2) {
+    p->bb_ori[1] ^= b;
+  }
+}
+
+// Rebuilds the bitboards of p from its board.
+void init_bitboards(position_t* p) {
+  memset(p->bb_pieces, 0, sizeof(p->bb_pieces));
+  memset(p->bb_ori, 0, sizeof(p->bb_ori));
+  memset(p->psq_score, 0, sizeof(p->psq_score));
+  for (fil_t f = 0; f < BOARD_WIDTH; f++) {
+    for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
+      square_t sq = square_of(f, r);
+      bb_toggle(p, sq, p->board[sq]);
+    }
+  }
+}
+
+// Whether the bitboards of p agree with its board, for use in assertions.
+bool bitboards_consistent(position_t* p) {
+  position_t q;
+  memcpy(q.board, p->board, sizeof(q.board));
+  init_bitboards(&q);
+  return memcmp(q.bb_pieces, p->bb_pieces, sizeof(q.bb_pieces)) == 0 &&
+         memcmp(q.bb_ori, p->bb_ori, sizeof(q.bb_ori)) == 0;
+}
+
 // -----------------------------------------------------------------------------
 // Board direction and laser direction
 // -----------------------------------------------------------------------------
@@ -275,6 +396,173 @@ void move_to_str(move_t mv, char* buf, size_t bufsize) {
   }
 }
 
+// -----------------------------------------------------------------------------
+// Symmetries
+// -----------------------------------------------------------------------------
+
+// Where symmetry s takes each square, and each piece; squares off the board
+// and pieces that are not Pawns or Kings stay put.
+static uint8_t  sym_squares[NUM_SYMMETRIES][ARR_SIZE];
+static piece_t  sym_pieces[NUM_SYMMETRIES][1 << PIECE_SIZE];
+static int      sym_inverses[NUM_SYMMETRIES];
+static uint64_t zob_empty;  // the key of the empty board, White to move
+
+// The directions the orientations face, as (file, rank) steps
+static const int king_ori_steps[NUM_ORI][2] = {
+  {0, 1}, {1, 0}, {0, -1}, {-1, 0}  // NN, EE, SS, WW
+};
+static const int pawn_ori_steps[NUM_ORI][2] = {
+  {-1, 1}, {1, 1}, {1, -1}, {-1, -1}  // NW, NE, SE, SW
+};
+
+// Applies the board transformation of s to the step (*f, *r).
+static void sym_step(int s, int* f, int* r) {
+  if (s & SYM_TRANSPOSE) {
+    int t = *f;
+    *f = *r;
+    *r = t;
+  }
+  if (s & SYM_MIRROR_FILE) {
+    *f = -*f;
+  }
+  if (s & SYM_MIRROR_RANK) {
+    *r = -*r;
+  }
+}
+
+static int sym_ori(int s, const int steps[NUM_ORI][2], int ori) {
+  int f = steps[ori][0];
+  int r = steps[ori][1];
+  sym_step(s, &f, &r);
+  for (int o = 0; o < NUM_ORI; o++) {
+    if (steps[o][0] == f && steps[o][1] == r) {
+      return o;
+    }
+  }
+  tbassert(false, "No orientation faces (%d, %d)\n", f, r);
+  return ori;
+}
+
+static void init_symmetries() {
+  for (int s = 0; s < NUM_SYMMETRIES; s++) {
+    for (int sq = 0; sq < ARR_SIZE; sq++) {
+      sym_squares[s][sq] = sq;
+    }
+    for (fil_t f = 0; f < BOARD_WIDTH; f++) {
+      for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
+        fil_t sf = (s & SYM_TRANSPOSE) ? r : f;
+        rnk_t sr = (s & SYM_TRANSPOSE) ? f : r;
+        if (s & SYM_MIRROR_FILE) {
+          sf = BOARD_WIDTH - 1 - sf;
+        }
+        if (s & SYM_MIRROR_RANK) {
+          sr = BOARD_WIDTH - 1 - sr;
+        }
+        sym_squares[s][square_of(f, r)] = square_of(sf, sr);
+      }
+    }
+
+    for (int x = 0; x < (1 << PIECE_SIZE); x++) {
+      piece_t y = x;
+      ptype_t typ = ptype_of(y);
+      if (typ == PAWN || typ == KING) {
+        set_ori(&y, sym_ori(s, typ == KING ? king_ori_steps : pawn_ori_steps,
+                            ori_of(y)));
+        if (s & SYM_COLOR) {
+          set_color(&y, opp_color(color_of(y)));
+        }
+      }
+      sym_pieces[s][x] = y;
+    }
+  }
+
+  // Every transformation of the board is its own inverse, except for the
+  // quarter turns, which are a transposition and one mirror.
+  for (int s = 0; s < NUM_SYMMETRIES; s++) {
+    for (int inv = s & SYM_COLOR; inv < NUM_SYMMETRIES; inv++) {
+      bool undoes = true;
+      for (int sq = 0; sq < ARR_SIZE; sq++) {
+        undoes = undoes && sym_squares[inv][sym_squares[s][sq]] == sq;
+      }
+      if (undoes) {
+        sym_inverses[s] = inv;
+        break;
+      }
+    }
+  }
+
+  zob_empty = 0;
+  for (fil_t f = 0; f < BOARD_WIDTH; f++) {
+    for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
+      zob_empty ^= zob[square_of(f, r)][0];
+    }
+  }
+}
+
+square_t sym_square(int s, square_t sq) {
+  tbassert(s >= 0 && s < NUM_SYMMETRIES, "s: %d\n", s);
+  return sym_squares[s][sq];
+}
+
+piece_t sym_piece(int s, piece_t x) {
+  tbassert(s >= 0 && s < NUM_SYMMETRIES, "s: %d\n", s);
+  return sym_pieces[s][x];
+}
+
+int sym_inverse(int s) {
+  tbassert(s >= 0 && s < NUM_SYMMETRIES, "s: %d\n", s);
+  return sym_inverses[s];
+}
+
+// A mirror image turns clockwise rotations into counterclockwise ones.
+move_t sym_move(int s, move_t mv) {
+  if (mv == 0) {
+    return 0;
+  }
+  rot_t rot = rot_of(mv);
+  if (__builtin_parity(s & (SYM_TRANSPOSE | SYM_MIRROR_FILE | SYM_MIRROR_RANK)) &&
+      rot != NONE) {
+    rot = NUM_ORI - rot;
+  }
+  return move_of(ptype_mv_of(mv), rot, sym_squares[s][from_square(mv)],
+                 sym_squares[s][intermediate_square(mv)],
+                 sym_squares[s][to_square(mv)]);
+}
+
+// Only the squares with pieces differ from the empty board, so the key takes
+// as many lookups as there are pieces.
+uint64_t sym_key(int s, position_t* p) {
+  uint64_t key = zob_empty;
+  for (color_t c = WHITE; c <= BLACK; c++) {
+    for (int t = 0; t < 2; t++) {
+      for (bitboard_t b = p->bb_pieces[c][t]; b; b &= b - 1) {
+        square_t sq = square_of_bb_index(__builtin_ctzll(b));
+        square_t to = sym_squares[s][sq];
+        key ^= zob[to][sym_pieces[s][p->board[sq]]] ^ zob[to][0];
+      }
+    }
+  }
+  if ((color_to_move_of(p) == BLACK) != ((s & SYM_COLOR) != 0)) {
+    key ^= zob_color;
+  }
+  return key;
+}
+
+// The least key of the symmetric images of p is the same for all of them.
+uint64_t canonical_key(position_t* p, int* sym) {
+  uint64_t best = p->key;
+  *sym = 0;
+  for (int s = 1; s < NUM_SYMMETRIES; s++) {
+    uint64_t key = sym_key(s, p);
+    if (key < best) {
+      best = key;
+      *sym = s;
+    }
+  }
+  tbassert(p->key == sym_key(0, p), "p->key: %"PRIu64"\n", p->key);
+  return best;
+}
+
 // -----------------------------------------------------------------------------
 // Move generation
 // -----------------------------------------------------------------------------
@@ -285,6 +573,15 @@ void move_to_str(move_t mv, char* buf, size_t bufsize) {
 // https://www.chessprogramming.org/Move_Generation
 int generate_all(position_t* p, sortable_move_t* sortable_move_list,
                  bool strict) {
+  if (USE_BITBOARDS) {
+    return generate_all_bitboard(p, sortable_move_list, strict);
+  }
+  return generate_all_mailbox(p, sortable_move_list, strict);
+}
+
+// Reference generator: scans every square of the mailbox board.
+int generate_all_mailbox(position_t* p, sortable_move_t* sortable_move_list,
+                         bool strict) {
   color_t color_to_move = color_to_move_of(p);
 
   int move_count = 0;
@@ -409,6 +706,119 @@ int generate_all(position_t* p, sortable_move_t* sortable_move_list,
   return move_count;
 }
 
+// Bitboard generator: visits only the pieces of the side to move.  Pieces,
+// directions, and double-move destinations are all enumerated in ascending bit
+// order, which is the order generate_all_mailbox() uses, so both produce the
+// same move list.
+int generate_all_bitboard(position_t* p, sortable_move_t* sortable_move_list,
+                          bool strict) {
+  return generate_moves_from(p, sortable_move_list, color_to_move_of(p), ~0ULL);
+}
+
+// Generates the moves of the pieces of color color_to_move that stand on the
+// squares in from, in the same order generate_all would produce them.
+int generate_moves_from(position_t* p, sortable_move_t* sortable_move_list,
+                        color_t color_to_move, bitboard_t from) {
+  bitboard_t own = p->bb_pieces[color_to_move][PAWN - PAWN] |
+                   p->bb_pieces[color_to_move][KING - PAWN];
+  bitboard_t opp = p->bb_pieces[opp_color(color_to_move)][PAWN - PAWN] |
+                   p->bb_pieces[opp_color(color_to_move)][KING - PAWN];
+  bitboard_t occupied = own | opp;
+
+  tbassert(bitboards_consistent(p), "bitboards out of sync with board\n");
+
+  int move_count = 0;
+
+  for (bitboard_t pieces = own & from; pieces; pieces &= pieces - 1) {
+    int i = __builtin_ctzll(pieces);
+    bitboard_t from_bb = 1ULL << i;
+    square_t sq = square_of_bb_index(i);
+    ptype_t typ = (p->bb_pieces[color_to_move][KING - PAWN] & from_bb) ? KING : PAWN;
+
+    for (bitboard_t dests = bb_neighbors(from_bb) & ~own; dests;
+         dests &= dests - 1) {
+      int j = __builtin_ctzll(dests);
+      bitboard_t dest_bb = 1ULL << j;
+      square_t dest = square_of_bb_index(j);
+
+      if (!(opp & dest_bb)) {
+        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+        sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, sq, dest);
+        continue;
+      }
+
+      // Swap with an enemy piece, then either step to an empty square ...
+      for (bitboard_t finals = bb_neighbors(dest_bb) & ~occupied; finals;
+           finals &= finals - 1) {
+        square_t final_dest = square_of_bb_index(__builtin_ctzll(finals));
+        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+        sortable_move_list[move_count++] = move_of(typ, (rot_t) 0, sq, dest, final_dest);
+      }
+
+      // ... or rotate in place (swap-rotates)
+      for (int rot = 1; rot < 4; ++rot) {
+        tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+        sortable_move_list[move_count++] = move_of(typ, (rot_t) rot, sq, dest, dest);
+      }
+    }
+
+    // rotations - three directions possible
+    for (int rot = 1; rot < 4; ++rot) {
+      tbassert(move_count < MAX_NUM_MOVES, "move_count: %d\n", move_count);
+      sortable_move_list[move_count++] = move_of(typ, (rot_t) rot, sq, sq, sq);
+    }
+  }
+
+  return move_count;
+}
+
+// Whether generate_all(p, ..) would produce mv, decided without generating
+// anything.  The search uses this to try the hash move and the killers, which
+// come from other positions, before generating the moves of p.
+bool is_generated_move(position_t* p, move_t mv) {
+  square_t from_sq = from_square(mv);
+  square_t int_sq = intermediate_square(mv);
+  square_t to_sq = to_square(mv);
+  color_t color = color_to_move_of(p);
+  piece_t from_piece = p->board[from_sq];
+
+  if (mv == 0 || ptype_of(p->board[int_sq]) == INVALID ||
+      ptype_of(p->board[to_sq]) == INVALID ||
+      ptype_of(from_piece) != ptype_mv_of(mv) ||
+      ptype_of(from_piece) == EMPTY || ptype_of(from_piece) == INVALID ||
+      color_of(from_piece) != color) {
+    return false;
+  }
+
+  bitboard_t occupied = p->bb_pieces[WHITE][PAWN - PAWN] |
+                        p->bb_pieces[WHITE][KING - PAWN] |
+                        p->bb_pieces[BLACK][PAWN - PAWN] |
+                        p->bb_pieces[BLACK][KING - PAWN];
+  bitboard_t from_bb = bb_of_square(from_sq);
+  bitboard_t int_bb = bb_of_square(int_sq);
+  bitboard_t to_bb = bb_of_square(to_sq);
+
+  if (to_sq == from_sq) {  // rotation
+    return int_sq == from_sq && rot_of(mv) != NONE;
+  }
+  if (int_sq == from_sq) {  // move to an empty neighbor
+    return rot_of(mv) == NONE && (bb_neighbors(from_bb) & to_bb) &&
+           !(occupied & to_bb);
+  }
+
+  // swap with an adjacent enemy piece ...
+  piece_t int_piece = p->board[int_sq];
+  if (!(bb_neighbors(from_bb) & int_bb) || ptype_of(int_piece) == EMPTY ||
+      color_of(int_piece) == color) {
+    return false;
+  }
+  if (to_sq == int_sq) {  // ... and rotate
+    return rot_of(mv) != NONE;
+  }
+  // ... and step to an empty square next to it
+  return rot_of(mv) == NONE && (bb_neighbors(int_bb) & to_bb) &&
+         !(occupied & to_bb);
+}
 
 int generate_all_with_color(position_t* p, sortable_move_t* sortable_move_list, 
                  color_t color) {
@@ -427,41 +837,78 @@ int generate_all_with_color(position_t* p, sortable_move_t* sortable_move_list,
 }
 
 // -----------------------------------------------------------------------------
-// Move execution
+// Laser paths
 // -----------------------------------------------------------------------------
 
-// Returns the square of piece that would be zapped by the laser if fired once,
-// or 0 if no such piece exists.
-//
-// p : Current board state.
-// c : Color of king shooting laser.
-square_t fire_laser(position_t* p, color_t c) {
-  // color_t fake_color_to_move = (color_to_move_of(p) == WHITE) ? BLACK : WHITE;0
-  square_t sq = p->kloc[c];
-  int bdir = ori_of(p->board[sq]);
-
-  tbassert(ptype_of(p->board[sq]) == KING,
-           "ptype: %d\n", ptype_of(p->board[sq]));
+// Squares after from_sq along beam direction bdir, up to and including to_sq,
+// or up to the edge of the board if to_sq is 0.
+bitboard_t bb_ray(square_t from_sq, int bdir, square_t to_sq) {
+  int i = bb_index_of(from_sq);
+  int r = i % BOARD_WIDTH;
+  bitboard_t mask = ~0ULL;
+  int lo;
+  int hi;
+
+  switch (bdir) {
+  case NN:
+    lo = i + 1;
+    hi = to_sq ? bb_index_of(to_sq) : i - r + BOARD_WIDTH - 1;
+    break;
+  case SS:
+    lo = to_sq ? bb_index_of(to_sq) : i - r;
+    hi = i - 1;
+    break;
+  case EE:
+    lo = i + BOARD_WIDTH;
+    hi = to_sq ? bb_index_of(to_sq) : BB_SIZE - BOARD_WIDTH + r;
+    mask = BB_RANK_FIRST << r;
+    break;
+  default:  // WW
+    lo = to_sq ? bb_index_of(to_sq) : r;
+    hi = i - BOARD_WIDTH;
+    mask = BB_RANK_FIRST << r;
+    break;
+  }
+  if (lo > hi) {
+    return 0;
+  }
+  // Bits lo..hi inclusive.  For hi == 63 the shift wraps to 0, which still
+  // gives the right answer in unsigned arithmetic.
+  return ((2ULL << hi) - (1ULL << lo)) & mask;
+}
 
+// Follows the beam from sq, which is already on the path, in direction bdir
+// until it zaps a piece or leaves the board, appending to lp.
+static void trace_laser_path(position_t* p, laser_path_t* lp, square_t sq,
+                             int bdir) {
   while (true) {
     sq += beam_of(bdir);
     tbassert(sq < ARR_SIZE && sq >= 0, "sq: %d\n", sq);
 
     switch (ptype_of(p->board[sq])) {
     case EMPTY:  // empty square
+      lp->squares |= bb_of_square(sq);
       break;
     case PAWN:  // Pawn
+      lp->squares |= bb_of_square(sq);
       bdir = reflect_of(bdir, ori_of(p->board[sq]));
       if (bdir < 0) {  // Hit back of Pawn
-        return sq;
+        lp->end = sq;
+        return;
       }
+      tbassert(lp->num_bounces < MAX_LASER_BOUNCES,
+               "num_bounces: %d\n", lp->num_bounces);
+      lp->bounce_sq[lp->num_bounces] = sq;
+      lp->bounce_dir[lp->num_bounces] = bdir;
+      lp->num_bounces++;
       break;
     case KING:  // King
-      return sq;  // sorry, game over my friend!
-      break;
+      lp->squares |= bb_of_square(sq);
+      lp->end = sq;  // sorry, game over my friend!
+      return;
     case INVALID:  // Ran off edge of board
-      return 0;
-      break;
+      lp->end = 0;
+      return;
     default:  // Shouldna happen, man!
       tbassert(false, "Like porkchops and whipped cream.\n");
       break;
@@ -469,7 +916,233 @@ square_t fire_laser(position_t* p, color_t c) {
   }
 }
 
-void low_level_make_move(position_t* old, position_t* p, move_t mv) {
+// Traces the beam of King c from scratch.
+static void init_laser_path(position_t* p, color_t c) {
+  laser_path_t* lp = &p->laser[c];
+  square_t sq = p->kloc[c];
+
+  tbassert(ptype_of(p->board[sq]) == KING,
+           "ptype: %d\n", ptype_of(p->board[sq]));
+
+  lp->squares = bb_of_square(sq);
+  lp->num_bounces = 0;
+  trace_laser_path(p, lp, sq, ori_of(p->board[sq]));
+}
+
+void init_laser_paths(position_t* p) {
+  init_laser_path(p, WHITE);
+  init_laser_path(p, BLACK);
+}
+
+// Brings the beam of King c up to date after the contents of the squares in
+// touched have changed.  The segments in front of the first touched square
+// are kept, and the beam is re-traced from the start of that segment.
+static void update_laser_path(position_t* p, color_t c, bitboard_t touched) {
+  laser_path_t* lp = &p->laser[c];
+  if (!(lp->squares & touched)) {
+    return;  // the beam never looks at the squares that changed
+  }
+
+  square_t sq = p->kloc[c];
+  if (touched & bb_of_square(sq)) {
+    init_laser_path(p, c);  // the King itself moved or turned
+    return;
+  }
+
+  bitboard_t prefix = bb_of_square(sq);
+  int bdir = ori_of(p->board[sq]);
+  for (int k = 0; k <= lp->num_bounces; k++) {
+    square_t seg_end = (k < lp->num_bounces) ? lp->bounce_sq[k] : lp->end;
+    bitboard_t segment = bb_ray(sq, bdir, seg_end);
+    if (segment & touched) {
+      lp->squares = prefix;
+      lp->num_bounces = k;
+      trace_laser_path(p, lp, sq, bdir);
+      return;
+    }
+    prefix |= segment;
+    if (k < lp->num_bounces) {
+      sq = lp->bounce_sq[k];
+      bdir = lp->bounce_dir[k];
+    }
+  }
+  tbassert(false, "touched square not found on laser path\n");
+}
+
+static void update_laser_paths(position_t* p, bitboard_t touched) {
+  update_laser_path(p, WHITE, touched);
+  update_laser_path(p, BLACK, touched);
+}
+
+// Whether the cached laser paths of p match a fresh trace, for use in
+// assertions.
+bool laser_paths_consistent(position_t* p) {
+  position_t q = *p;
+  init_laser_paths(&q);
+  for (color_t c = WHITE; c <= BLACK; c++) {
+    laser_path_t* a = &p->laser[c];
+    laser_path_t* b = &q.laser[c];
+    if (a->squares != b->squares || a->end != b->end ||
+        a->num_bounces != b->num_bounces ||
+        memcmp(a->bounce_sq, b->bounce_sq, b->num_bounces) != 0 ||
+        memcmp(a->bounce_dir, b->bounce_dir, b->num_bounces) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// Zaps
+// -----------------------------------------------------------------------------
+
+// Square of the piece that the beam of the King on sq zaps, or 0 if the beam
+// leaves the board.  Reads nothing of p but its board.
+static square_t laser_end_from(position_t* p, square_t sq) {
+  laser_path_t lp;
+  lp.squares = bb_of_square(sq);
+  lp.end = 0;
+  lp.num_bounces = 0;
+  trace_laser_path(p, &lp, sq, ori_of(p->board[sq]));
+  return lp.end;
+}
+
+// Puts the pieces that mv moves where it leaves them, on the board of p only,
+// saving what the from, intermediate and to squares held before in saved.
+static void place_pieces(position_t* p, move_t mv, piece_t saved[3]) {
+  square_t from_sq = from_square(mv);
+  square_t int_sq = intermediate_square(mv);
+  square_t to_sq = to_square(mv);
+  piece_t from_piece = saved[0] = p->board[from_sq];
+  piece_t int_piece = saved[1] = p->board[int_sq];
+  piece_t to_piece = saved[2] = p->board[to_sq];
+
+  if (to_sq == from_sq) {  // rotation
+    set_ori(&from_piece, rot_of(mv) + ori_of(from_piece));
+    p->board[from_sq] = from_piece;
+  } else if (int_sq == from_sq) {  // move to an empty neighbor
+    p->board[to_sq] = from_piece;
+    p->board[from_sq] = to_piece;
+  } else if (int_sq != to_sq) {  // swap and step
+    p->board[from_sq] = int_piece;
+    p->board[int_sq] = to_piece;
+    p->board[to_sq] = from_piece;
+  } else {  // swap and rotate
+    set_ori(&from_piece, rot_of(mv) + ori_of(from_piece));
+    p->board[from_sq] = int_piece;
+    p->board[int_sq] = from_piece;
+  }
+}
+
+// Undoes place_pieces.
+static void unplace_pieces(position_t* p, move_t mv, const piece_t saved[3]) {
+  p->board[to_square(mv)] = saved[2];
+  p->board[intermediate_square(mv)] = saved[1];
+  p->board[from_square(mv)] = saved[0];
+}
+
+// Static exchange estimate of mv for the side to move: the value of the piece
+// that its laser zaps after mv, less that of the piece that the opponent's
+// laser would zap in reply if the opponent left its beam as it is.  Zapping
+// a King is worth the game.  Sets *victim to the square zapped by mv, or to 0
+// if mv zaps nothing, in which case the exchange is 0.
+//
+// Neither move is made: the beams are traced on the board as mv leaves it,
+// and only if mv touches them.
+//
+// https://www.chessprogramming.org/Static_Exchange_Evaluation
+static int zap_exchange(position_t* p, move_t mv, square_t* victim) {
+  color_t c = color_to_move_of(p);
+  color_t o = opp_color(c);
+  square_t sq[3] = { from_square(mv), intermediate_square(mv), to_square(mv) };
+  bitboard_t touched = bb_of_square(sq[0]) | bb_of_square(sq[1]) |
+                       bb_of_square(sq[2]);
+
+  piece_t saved[3];
+  place_pieces(p, mv, saved);
+  square_t king[2] = { p->kloc[WHITE], p->kloc[BLACK] };
+  for (int i = 0; i < 3; i++) {
+    if (ptype_of(p->board[sq[i]]) == KING) {
+      king[color_of(p->board[sq[i]])] = sq[i];
+    }
+  }
+
+  int exchange = 0;
+  *victim = (p->laser[c].squares & touched) ? laser_end_from(p, king[c])
+                                            : p->laser[c].end;
+  if (*victim != 0) {
+    piece_t v = p->board[*victim];
+    int value = (ptype_of(v) == KING) ? WIN : PAWN_VALUE;
+    if (color_of(v) == c) {
+      exchange = -value;
+    } else if (ptype_of(v) == KING) {
+      exchange = value;  // no reply to that
+    } else {
+      exchange = value;
+      p->board[*victim] = 0;
+      touched |= bb_of_square(*victim);
+      square_t reply = (p->laser[o].squares & touched) ? laser_end_from(p, king[o])
+                                                       : p->laser[o].end;
+      if (reply != 0 && color_of(p->board[reply]) == c) {
+        exchange -= (ptype_of(p->board[reply]) == KING) ? WIN : PAWN_VALUE;
+      }
+      p->board[*victim] = v;
+    }
+  }
+
+  unplace_pieces(p, mv, saved);
+  return exchange;
+}
+
+// Generates the moves of p after which the laser of the side to move zaps a
+// piece, for the quiescence search, and sets exchange[i] to the static
+// exchange of the i-th (see zap_exchange).  Zaps that lose material by that
+// estimate are left out, so the list is empty more often than not.
+//
+// A move can only change what the beam zaps by touching a square on it, and
+// only pieces at most two squares from the beam can do that.  If the beam
+// already zaps a piece, though, so does every move that leaves it alone.
+int generate_zaps(position_t* p, sortable_move_t* sortable_move_list,
+                  int* exchange) {
+  color_t c = color_to_move_of(p);
+  bitboard_t near = ~0ULL;
+  if (p->laser[c].end == 0) {
+    near = p->laser[c].squares | bb_neighbors(p->laser[c].squares);
+    near |= bb_neighbors(near);
+  }
+
+  sortable_move_t moves[MAX_NUM_MOVES];
+  int num_moves = generate_moves_from(p, moves, c, near);
+  int move_count = 0;
+  for (int i = 0; i < num_moves; i++) {
+    move_t mv = get_move(moves[i]);
+    square_t victim;
+    int e = zap_exchange(p, mv, &victim);
+    if (victim != 0 && e >= 0) {
+      sortable_move_list[move_count] = mv;
+      exchange[move_count] = e;
+      move_count++;
+    }
+  }
+  return move_count;
+}
+
+// -----------------------------------------------------------------------------
+// Move execution
+// -----------------------------------------------------------------------------
+
+// Returns the square of piece that would be zapped by the laser if fired once,
+// or 0 if no such piece exists.  The answer comes from the cached laser path.
+//
+// p : Current board state.
+// c : Color of king shooting laser.
+square_t fire_laser(position_t* p, color_t c) {
+  tbassert(laser_paths_consistent(p), "stale laser path\n");
+  return p->laser[c].end;
+}
+
+// Move phase 1 of mv, which moves (or rotates) pieces of p in place.
+static void apply_move(position_t* p, move_t mv) {
   tbassert(mv != 0, "mv was zero.\n");
 
   WHEN_DEBUG_VERBOSE(char buf[MAX_CHARS_IN_MOVE]);
@@ -478,13 +1151,13 @@ void low_level_make_move(position_t* old, position_t* p, move_t mv) {
     DEBUG_LOG(1, "low_level_make_move: %s\n", buf);
   });
 
-  tbassert(old->key == compute_zob_key(old),
-           "old->key: %"PRIu64", zob-key: %"PRIu64"\n",
-           old->key, compute_zob_key(old));
+  tbassert(p->key == compute_zob_key(p),
+           "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
+           p->key, compute_zob_key(p));
 
   WHEN_DEBUG_VERBOSE({
     fprintf(stderr, "Before:\n");
-    display(old);
+    display(p);
   });
 
   square_t from_sq = from_square(mv);
@@ -519,16 +1192,13 @@ void low_level_make_move(position_t* old, position_t* p, move_t mv) {
     }
   });
 
-  *p = *old;
-
-  p->history = old;
   p->last_move = mv;
 
   tbassert(from_sq < ARR_SIZE && from_sq > 0, "from_sq: %d\n", from_sq);
-  tbassert(p->board[from_sq] < (1 << PIECE_SIZE) && p->board[from_sq] >= 0,
+  tbassert(p->board[from_sq] < (1 << PIECE_SIZE),
            "p->board[from_sq]: %d\n", p->board[from_sq]);
   tbassert(to_sq < ARR_SIZE && to_sq > 0, "to_sq: %d\n", to_sq);
-  tbassert(p->board[to_sq] < (1 << PIECE_SIZE) && p->board[to_sq] >= 0,
+  tbassert(p->board[to_sq] < (1 << PIECE_SIZE),
            "p->board[to_sq]: %d\n", p->board[to_sq]);
 
   p->key ^= zob_color;   // swap color to move
@@ -538,6 +1208,16 @@ void low_level_make_move(position_t* old, position_t* p, move_t mv) {
   piece_t to_piece = p->board[to_sq];
   bool is_double_move = false;
 
+  // Lift the touched squares out of the bitboards; they are put back once the
+  // board has been updated.
+  bb_toggle(p, from_sq, from_piece);
+  if (int_sq != from_sq) {
+    bb_toggle(p, int_sq, int_piece);
+  }
+  if (to_sq != from_sq && to_sq != int_sq) {
+    bb_toggle(p, to_sq, to_piece);
+  }
+
   if (to_sq != from_sq) {  // move, not rotation
     // Hash key updates
     p->key ^= zob[from_sq][from_piece];  // remove from_piece from from_sq
@@ -547,13 +1227,14 @@ void low_level_make_move(position_t* old, position_t* p, move_t mv) {
       // This is a double move
       is_double_move = true;
 
-      p->key ^= zob[int_sq][int_piece];  // remove int_piece from int_sq
-
       p->board[from_sq] = int_piece;  // swap from_piece and int_piece on board
       p->board[int_sq] = from_piece;
 
       if(int_sq != to_sq){
         // Either a swap-move or a swap-swap
+        // (for a swap-rotate, int_piece was already removed as to_piece)
+        p->key ^= zob[int_sq][int_piece];  // remove int_piece from int_sq
+
         p->board[int_sq] = to_piece;  // Pieces should move the order from->to, to->int, int->from
         p->board[to_sq] = from_piece;
 
@@ -604,12 +1285,25 @@ void low_level_make_move(position_t* old, position_t* p, move_t mv) {
     p->key ^= zob[from_sq][from_piece];              // ... and in hash
   }
 
+  bb_toggle(p, from_sq, p->board[from_sq]);
+  if (int_sq != from_sq) {
+    bb_toggle(p, int_sq, p->board[int_sq]);
+  }
+  if (to_sq != from_sq && to_sq != int_sq) {
+    bb_toggle(p, to_sq, p->board[to_sq]);
+  }
+
+  update_laser_paths(p, bb_of_square(from_sq) | bb_of_square(int_sq) |
+                        bb_of_square(to_sq));
+
   // Increment ply
   p->ply++;
 
   tbassert(p->key == compute_zob_key(p),
            "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
            p->key, compute_zob_key(p));
+  tbassert(bitboards_consistent(p), "bitboards out of sync with board\n");
+  tbassert(laser_paths_consistent(p), "stale laser path\n");
 
   WHEN_DEBUG_VERBOSE({
     fprintf(stderr, "After:\n");
@@ -617,20 +1311,52 @@ void low_level_make_move(position_t* old, position_t* p, move_t mv) {
   });
 }
 
-// return victim pieces or KO
-victims_t make_move(position_t* old, position_t* p, move_t mv) {
-  tbassert(mv != 0, "mv was zero.\n");
+void low_level_make_move(position_t* old, position_t* p, move_t mv) {
+  *p = *old;
+  p->history = old;
+  apply_move(p, mv);
+}
 
-  WHEN_DEBUG_VERBOSE(char buf[MAX_CHARS_IN_MOVE]);
+// The key of the position after mv, assuming that the laser zaps nothing.
+// Cheap enough to compute for every child, so that the search can prefetch
+// their hash table entries before making the moves.
+uint64_t zob_key_after_move(position_t* p, move_t mv) {
+  square_t from_sq = from_square(mv);
+  square_t int_sq = intermediate_square(mv);
+  square_t to_sq = to_square(mv);
+  piece_t from_piece = p->board[from_sq];
+  piece_t int_piece = p->board[int_sq];
+  piece_t to_piece = p->board[to_sq];
+  piece_t rotated = from_piece;
+  set_ori(&rotated, rot_of(mv) + ori_of(from_piece));
 
-  // move phase 1 - moving a piece
-  low_level_make_move(old, p, mv);
+  uint64_t key = p->key ^ zob_color;
+  if (to_sq == from_sq) {  // rotation
+    return key ^ zob[from_sq][from_piece] ^ zob[from_sq][rotated];
+  }
+
+  key ^= zob[from_sq][from_piece] ^ zob[to_sq][to_piece];
+  if (int_sq == from_sq) {  // move or swap
+    return key ^ zob[to_sq][from_piece] ^ zob[from_sq][to_piece];
+  }
+  if (int_sq == to_sq) {  // swap-rotate
+    return key ^ zob[from_sq][int_piece] ^ zob[int_sq][rotated];
+  }
+  // swap-move or swap-swap
+  return key ^ zob[int_sq][int_piece] ^ zob[int_sq][to_piece] ^
+         zob[to_sq][from_piece] ^ zob[from_sq][int_piece];
+}
+
+// Move phase 2, which fires the laser of color c, the side that just moved,
+// and removes the piece it zaps from p.  Returns the square of that piece, or 0
+// if the beam left the board.
+static square_t zap(position_t* p, color_t c) {
+  WHEN_DEBUG_VERBOSE(char buf[MAX_CHARS_IN_MOVE]);
 
-  // move phase 2 - shooting the laser
   square_t victim_sq = 0;
   p->victims.zapped_count = 0;
 
-  if ((victim_sq = fire_laser(p, color_to_move_of(old)))) {
+  if ((victim_sq = fire_laser(p, c))) {
     WHEN_DEBUG_VERBOSE({
       square_to_str(victim_sq, buf, MAX_CHARS_IN_MOVE);
       DEBUG_LOG(1, "Zapping piece on %s\n", buf);
@@ -638,11 +1364,19 @@ victims_t make_move(position_t* old, position_t* p, move_t mv) {
 
     // we definitely hit something with laser, remove it from board
     piece_t victim_piece = p->board[victim_sq];
+    tbassert((ptype_of(victim_piece) != EMPTY) &&
+             (ptype_of(victim_piece) != INVALID),
+             "type: %d\n", ptype_of(victim_piece));
+
     p->victims.zapped_count++;
     p->victims.zapped = victim_piece;
     p->key ^= zob[victim_sq][victim_piece];
+    bb_toggle(p, victim_sq, victim_piece);
     p->board[victim_sq] = 0;
     p->key ^= zob[victim_sq][0];
+    if (ptype_of(victim_piece) != KING) {  // else game over; beams are moot
+      update_laser_paths(p, bb_of_square(victim_sq));
+    }
 
     tbassert(p->key == compute_zob_key(p),
              "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
@@ -653,6 +1387,21 @@ victims_t make_move(position_t* old, position_t* p, move_t mv) {
       DEBUG_LOG(1, "Zapped piece on %s\n", buf);
     });
   }
+  return victim_sq;
+}
+
+// return victim pieces or KO
+victims_t make_move(position_t* old, position_t* p, move_t mv) {
+  tbassert(mv != 0, "mv was zero.\n");
+
+  // move phase 1 - moving a piece
+  low_level_make_move(old, p, mv);
+
+  // move phase 2 - shooting the laser
+  zap(p, color_to_move_of(old));
+
+  tbassert(p->victims.zapped_count > 0 || p->key == zob_key_after_move(old, mv),
+           "zob_key_after_move disagrees with make_move\n");
 
   if (USE_KO) {  // Ko rule
     if (p->key == (old->key ^ zob_color)) {
@@ -694,76 +1443,357 @@ victims_t make_move(position_t* old, position_t* p, move_t mv) {
 }
 
 // -----------------------------------------------------------------------------
-// Move path enumeration (perft)
+// Make and unmake in place
 // -----------------------------------------------------------------------------
 
-// Helper function for do_perft() (ply starting with 0).
+// Searches that walk down and back up the tree can make their moves in p
+// itself, saving only what a move changes in an undo record:
 //
-// NOTE: This function reimplements some of the logic for make_move().
-static uint64_t perft_search(position_t* p, int depth, int ply) {
-  uint64_t node_count = 0;
-  position_t np;
-  sortable_move_t lst[MAX_NUM_MOVES];
-  int num_moves;
-  int i;
+//   undo_t u;
+//   make_move_in_place(p, mv, prev, &u);
+//   ... p is the child ...
+//   unmake_move(p, &u);
+//
+// p->history is left alone.  Whoever needs the positions in between, as the
+// Ko rule and the detection of repetitions do, finds them in the undo
+// records.
+
+static void record_square(undo_t* u, position_t* p, square_t sq) {
+  tbassert(u->num_squares < MAX_UNDO_SQUARES, "num_squares: %d\n",
+           u->num_squares);
+  u->sq[u->num_squares] = sq;
+  u->piece[u->num_squares] = p->board[sq];
+  u->num_squares++;
+}
 
-  if (depth == 0) {
-    return 1;
+// The contents of sq before the move of u, given those after it
+static piece_t piece_before(const undo_t* u, square_t sq, piece_t after) {
+  for (int i = 0; i < u->num_squares; i++) {
+    if (u->sq[i] == sq) {
+      return u->piece[i];  // the first record of a square is the oldest
+    }
   }
+  return after;
+}
 
-  num_moves = generate_all(p, lst, true);
+// Move phase 1 of mv in p itself, as low_level_make_move does in a copy.
+void low_level_make_move_in_place(position_t* p, move_t mv, undo_t* u) {
+  u->key = p->key;
+  u->last_move = p->last_move;
+  u->victims = p->victims;
+  u->kloc[WHITE] = p->kloc[WHITE];
+  u->kloc[BLACK] = p->kloc[BLACK];
+  u->psq_score[WHITE] = p->psq_score[WHITE];
+  u->psq_score[BLACK] = p->psq_score[BLACK];
+  memcpy(u->bb_pieces, p->bb_pieces, sizeof(u->bb_pieces));
+  memcpy(u->bb_ori, p->bb_ori, sizeof(u->bb_ori));
+  memcpy(u->laser, p->laser, sizeof(u->laser));
+
+  u->num_squares = 0;
+  record_square(u, p, from_square(mv));
+  record_square(u, p, intermediate_square(mv));
+  record_square(u, p, to_square(mv));
+
+  apply_move(p, mv);
+}
 
-  if (depth == 1) {
-    return num_moves;
+// Move phase 2 after low_level_make_move_in_place, which also records the
+// zapped square in u.
+static void zap_in_place(position_t* p, undo_t* u) {
+  square_t victim_sq = zap(p, opp_color(color_to_move_of(p)));
+  if (victim_sq) {
+    u->sq[u->num_squares] = victim_sq;
+    u->piece[u->num_squares] = p->victims.zapped;
+    u->num_squares++;
   }
+}
 
-  for (i = 0; i < num_moves; i++) {
-    move_t mv = get_move(lst[i]);
-
-    low_level_make_move(p, &np, mv);  // make the move baby!
+// Both phases of mv in p itself, as make_move does in a copy.  prev is the
+// record of the move that led to p, or NULL if p->history is the position
+// before p; the Ko rule compares the result with that position.  Even if
+// this returns KO, the move has been made and must be unmade.
+victims_t make_move_in_place(position_t* p, move_t mv, const undo_t* prev,
+                             undo_t* u) {
+  tbassert(mv != 0, "mv was zero.\n");
 
-    square_t victim_sq = 0;  // the guys to disappear
-    np.victims.zapped_count = 0;
+  low_level_make_move_in_place(p, mv, u);
+  zap_in_place(p, u);
 
-    if ((victim_sq = fire_laser(&np, color_to_move_of(p)))) {  // hit a piece
-      piece_t victim_piece = np.board[victim_sq];
-      tbassert((ptype_of(victim_piece) != EMPTY) &&
-               (ptype_of(victim_piece) != INVALID),
-               "type: %d\n", ptype_of(victim_piece));
+  if (USE_KO) {  // Ko rule
+    // The position before the move differs from p only on the squares of u.
+    if (p->key == (u->key ^ zob_color)) {
+      bool match = true;
+      for (int i = 0; i < u->num_squares; i++) {
+        if (p->board[u->sq[i]] != piece_before(u, u->sq[i], 0)) {
+          match = false;
+        }
+      }
+      if (match) {
+        return KO();
+      }
+    }
 
-      np.victims.zapped_count++;
-      np.victims.zapped = victim_piece;
-      np.key ^= zob[victim_sq][victim_piece];   // remove from board
-      np.board[victim_sq] = 0;
-      np.key ^= zob[victim_sq][0];
+    // The position before that differs from p only on the squares of u and
+    // prev.
+    uint64_t history_key = prev ? prev->key : p->history->key;
+    if (p->key == history_key) {
+      bool match = true;
+      if (prev == NULL) {
+        for (fil_t f = 0; f < BOARD_WIDTH; f++) {
+          for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
+            if (p->board[square_of(f, r)] !=
+                p->history->board[square_of(f, r)]) {
+              match = false;
+            }
+          }
+        }
+      } else {
+        for (int i = 0; i < u->num_squares; i++) {
+          square_t sq = u->sq[i];
+          if (p->board[sq] != piece_before(prev, sq, piece_before(u, sq, 0))) {
+            match = false;
+          }
+        }
+        for (int i = 0; i < prev->num_squares; i++) {
+          square_t sq = prev->sq[i];
+          if (p->board[sq] != piece_before(prev, sq, 0)) {
+            match = false;
+          }
+        }
+      }
+      if (match) {
+        return KO();
+      }
     }
+  }
+
+  return p->victims;
+}
+
+// Takes back the move of u, made in p by make_move_in_place or
+// low_level_make_move_in_place.
+void unmake_move(position_t* p, const undo_t* u) {
+  for (int i = u->num_squares - 1; i >= 0; i--) {
+    p->board[u->sq[i]] = u->piece[i];
+  }
+  p->key = u->key;
+  p->last_move = u->last_move;
+  p->victims = u->victims;
+  p->kloc[WHITE] = u->kloc[WHITE];
+  p->kloc[BLACK] = u->kloc[BLACK];
+  p->psq_score[WHITE] = u->psq_score[WHITE];
+  p->psq_score[BLACK] = u->psq_score[BLACK];
+  memcpy(p->bb_pieces, u->bb_pieces, sizeof(p->bb_pieces));
+  memcpy(p->bb_ori, u->bb_ori, sizeof(p->bb_ori));
+  memcpy(p->laser, u->laser, sizeof(p->laser));
+  p->ply--;
+
+  tbassert(p->key == compute_zob_key(p),
+           "p->key: %"PRIu64", zob-key: %"PRIu64"\n",
+           p->key, compute_zob_key(p));
+  tbassert(bitboards_consistent(p), "bitboards out of sync with board\n");
+}
+
+// -----------------------------------------------------------------------------
+// Move path enumeration (perft)
+// -----------------------------------------------------------------------------
+
+// Number of positions at which the two move generators disagreed during the
+// current cross-checking perft run.
+static uint64_t perft_mismatches;
+
+// Perft hash table, which remembers the count of each subtree by position and
+// depth.  As in the transposition table, the key is stored XORed with the
+// data, so that workers racing on an entry only ever see a miss.
+typedef struct {
+  uint64_t key_xor_data;
+  uint64_t data;  // count << PERFT_DEPTH_BITS | depth
+} perftEntry_t;
+
+#define PERFT_DEPTH_BITS 8
+#define PERFT_DEPTH_MASK ((1 << PERFT_DEPTH_BITS) - 1)
+
+static perftEntry_t* perft_table;  // NULL if perft runs without a hash table
+static uint64_t perft_mask;
+
+static bool perft_hash_get(uint64_t key, int depth, uint64_t* count) {
+  perftEntry_t* e = &perft_table[key & perft_mask];
+  uint64_t data = __atomic_load_n(&e->data, __ATOMIC_RELAXED);
+  uint64_t key_xor_data = __atomic_load_n(&e->key_xor_data, __ATOMIC_RELAXED);
+  if ((key_xor_data ^ data) != key || (data & PERFT_DEPTH_MASK) != depth) {
+    return false;
+  }
+  *count = data >> PERFT_DEPTH_BITS;
+  return true;
+}
+
+static void perft_hash_put(uint64_t key, int depth, uint64_t count) {
+  perftEntry_t* e = &perft_table[key & perft_mask];
+  uint64_t data = count << PERFT_DEPTH_BITS | depth;
+  __atomic_store_n(&e->data, data, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->key_xor_data, key ^ data, __ATOMIC_RELAXED);
+}
+
+// Compares the move list of generate_all_bitboard() against the reference
+// generate_all_mailbox() and reports the first difference.
+static void perft_cross_check(position_t* p, sortable_move_t* lst,
+                              int num_moves) {
+  sortable_move_t ref[MAX_NUM_MOVES];
+  int num_ref = generate_all_mailbox(p, ref, true);
+
+  int i = 0;
+  while (i < num_moves && i < num_ref && lst[i] == ref[i]) {
+    i++;
+  }
+  if (i == num_moves && i == num_ref) {
+    return;
+  }
 
-    if (np.victims.zapped_count > 0 &&
-        ptype_of(np.victims.zapped) == KING) {
-      // do not expand further: hit a King
-      node_count++;
-      continue;
+  if (__sync_fetch_and_add(&perft_mismatches, 1) == 0) {
+    char buf[MAX_CHARS_IN_MOVE] = "-";
+    char ref_buf[MAX_CHARS_IN_MOVE] = "-";
+    if (i < num_moves) {
+      move_to_str(get_move(lst[i]), buf, MAX_CHARS_IN_MOVE);
+    }
+    if (i < num_ref) {
+      move_to_str(get_move(ref[i]), ref_buf, MAX_CHARS_IN_MOVE);
     }
+    printf("info string perft mismatch: bitboard generated %d moves, "
+           "mailbox %d; move %d is %s vs. %s\n",
+           num_moves, num_ref, i, buf, ref_buf);
+    display(p);
+  }
+}
+
+static uint64_t perft_search(position_t* p, int depth, int ply,
+                             bool cross_check);
 
-    uint64_t partialcount = perft_search(&np, depth - 1, ply + 1);
-    node_count += partialcount;
+// The number of paths of length depth that start with mv from p.  The move is
+// made in p, and taken back before returning.
+//
+// NOTE: This function reimplements some of the logic for make_move().
+static uint64_t perft_move(position_t* p, move_t mv, int depth, int ply,
+                           bool cross_check) {
+  undo_t u;
+  low_level_make_move_in_place(p, mv, &u);  // make the move baby!
+
+  zap_in_place(p, &u);
+
+  uint64_t node_count;
+  if (p->victims.zapped_count > 0 && ptype_of(p->victims.zapped) == KING) {
+    node_count = 1;  // do not expand further: hit a King
+  } else {
+    node_count = perft_search(p, depth - 1, ply + 1, cross_check);
   }
 
+  unmake_move(p, &u);
+  return node_count;
+}
+
+// Generates the moves of p for perft, checking them against the mailbox
+// generator if asked to.
+static int perft_generate(position_t* p, sortable_move_t* lst,
+                          bool cross_check) {
+  if (!cross_check) {
+    return generate_all(p, lst, true);
+  }
+  int num_moves = generate_all_bitboard(p, lst, true);
+  perft_cross_check(p, lst, num_moves);
+  return num_moves;
+}
+
+// Helper function for do_perft() (ply starting with 0).
+static uint64_t perft_search(position_t* p, int depth, int ply,
+                             bool cross_check) {
+  uint64_t node_count = 0;
+  sortable_move_t lst[MAX_NUM_MOVES];
+
+  if (depth == 0) {
+    return 1;
+  }
+  if (depth > 1 && perft_table != NULL &&
+      perft_hash_get(p->key, depth, &node_count)) {
+    return node_count;
+  }
+
+  int num_moves = perft_generate(p, lst, cross_check);
+  if (depth == 1) {
+    return num_moves;
+  }
+
+  for (int i = 0; i < num_moves; i++) {
+    node_count += perft_move(p, get_move(lst[i]), depth, ply, cross_check);
+  }
+
+  if (perft_table != NULL) {
+    perft_hash_put(p->key, depth, node_count);
+  }
   return node_count;
 }
 
 // Debugging function to help verify that the move generator is working
-// correctly.
+// correctly.  With cross_check, every node is expanded by both the bitboard
+// and the mailbox generators, and any difference between them is reported.
+// The root moves are searched in parallel.  With hash_mb > 0, subtrees that
+// were counted before are looked up in a perft hash table of that many MB
+// instead, and with divide, the count of each root move at the last depth is
+// printed.
 //
 // https://www.chessprogramming.org/Perft
-void do_perft(position_t* gme, int depth, int ply) {
+void do_perft(position_t* gme, int depth, int ply, bool cross_check,
+              bool divide, int hash_mb) {
   fen_to_pos(gme, "");
 
+  if (hash_mb > 0) {
+    uint64_t num_entries = 1;
+    while (2 * num_entries * sizeof(perftEntry_t) <= (uint64_t) hash_mb << 20) {
+      num_entries *= 2;
+    }
+    perft_table = calloc(num_entries, sizeof(perftEntry_t));
+    perft_mask = num_entries - 1;
+    if (perft_table == NULL) {
+      fprintf(stderr, "Out of memory for a %d MB perft hash table\n", hash_mb);
+    }
+  }
+
+  sortable_move_t lst[MAX_NUM_MOVES];
+  uint64_t counts[MAX_NUM_MOVES];
+  int num_moves = 0;
   for (int d = 1; d <= depth; d++) {
+    perft_mismatches = 0;
+    double start = milliseconds();
+
+    num_moves = perft_generate(gme, lst, cross_check);
+    cilk_for (int i = 0; i < num_moves; i++) {
+      position_t np = *gme;  // each root move is made in a copy of its own
+      counts[i] = perft_move(&np, get_move(lst[i]), d, ply, cross_check);
+    }
+    uint64_t j = 0;
+    for (int i = 0; i < num_moves; i++) {
+      j += counts[i];
+    }
+
+    double ms = milliseconds() - start;
     printf("perft %2d ", d);
-    uint64_t j = perft_search(gme, d, 0);
     printf("%" PRIu64 "\n", j);
+    printf("info string perft %d: %.0f ms, %.0f nps\n",
+           d, ms, ms > 0 ? 1000 * j / ms : 0.0);
+    if (cross_check) {
+      printf("info string perft %d: %" PRIu64 " generator mismatches\n",
+             d, perft_mismatches);
+    }
+  }
+
+  if (divide) {
+    for (int i = 0; i < num_moves; i++) {
+      char buf[MAX_CHARS_IN_MOVE];
+      move_to_str(get_move(lst[i]), buf, MAX_CHARS_IN_MOVE);
+      printf("info string perft divide %s %" PRIu64 "\n", buf, counts[i]);
+    }
   }
+
+  free(perft_table);
+  perft_table = NULL;
 }
 
 // -----------------------------------------------------------------------------
@@ -20,12 +20,14 @@
 // Board
 // -----------------------------------------------------------------------------
 
-// The board (which is 8x8 or 10x10) is centered in a 16x16 array, with the
-// excess height and width being used for sentinels.
-#define ARR_WIDTH 16
+// The 8x8 board is centered in a 10x10 array, with the outer ring of squares
+// used for sentinels.  Moves only ever step to a neighbor and the laser stops
+// at the first sentinel, so one ring is enough.  Squares are stored file by
+// file: square (f, r) is ARR_WIDTH * (FIL_ORIGIN + f) + RNK_ORIGIN + r.
+#define ARR_WIDTH 10
 #define ARR_SIZE (ARR_WIDTH * ARR_WIDTH)
 
-// Board is 8 x 8 or 10 x 10
+// Board is 8 x 8
 #define BOARD_WIDTH 8
 
 typedef int square_t;
@@ -35,10 +37,22 @@ typedef int fil_t;
 #define FIL_ORIGIN ((ARR_WIDTH - BOARD_WIDTH) / 2)
 #define RNK_ORIGIN ((ARR_WIDTH - BOARD_WIDTH) / 2)
 
-#define FIL_SHIFT 4
-#define FIL_MASK 15
-#define RNK_SHIFT 0
-#define RNK_MASK 15
+// -----------------------------------------------------------------------------
+// Bitboards
+// -----------------------------------------------------------------------------
+
+// One bit per playable square, so this representation requires an 8 x 8 board.
+// Bit (BOARD_WIDTH * f + r) holds square (f, r), which makes ascending bit
+// order match the file-major scan order of the mailbox loops.
+//
+// https://www.chessprogramming.org/Bitboards
+typedef uint64_t bitboard_t;
+
+#define BB_SIZE (BOARD_WIDTH * BOARD_WIDTH)
+
+// Squares with rank 0 and rank BOARD_WIDTH - 1 respectively
+#define BB_RANK_FIRST 0x0101010101010101ULL
+#define BB_RANK_LAST  0x8080808080808080ULL
 
 // -----------------------------------------------------------------------------
 // Pieces
@@ -46,7 +60,7 @@ typedef int fil_t;
 
 #define PIECE_SIZE 5  // Number of bits in (ptype, color, orientation)
 
-typedef int piece_t;
+typedef uint8_t piece_t;
 
 // -----------------------------------------------------------------------------
 // Piece types
@@ -138,6 +152,48 @@ typedef struct victims_t {
 // returned by make move in ko situation
 #define ILLEGAL_ZAPPED -1
 
+// -----------------------------------------------------------------------------
+// Laser paths
+// -----------------------------------------------------------------------------
+
+// Each side starts with 7 Pawns and never gains more, so FENs are limited to
+// MAX_PAWNS.  A Pawn can reflect a beam off each of its two front faces.
+#define MAX_PAWNS 16
+#define MAX_LASER_BOUNCES (2 * MAX_PAWNS)
+
+// The beam fired by one King, cached in the position and updated by
+// low_level_make_move.  The path is a chain of straight segments: the first
+// one leaves the King along its orientation, and each reflection point starts
+// the next one.
+typedef struct laser_path {
+  bitboard_t squares;       // on-board squares touched, including the King's
+  square_t   end;           // square of the piece that gets zapped, or 0
+  int        num_bounces;   // number of reflection points
+  uint8_t    bounce_sq[MAX_LASER_BOUNCES];   // reflecting Pawns in beam order
+  uint8_t    bounce_dir[MAX_LASER_BOUNCES];  // beam direction leaving each one
+} laser_path_t;
+
+// -----------------------------------------------------------------------------
+// Symmetries
+// -----------------------------------------------------------------------------
+
+// The rules read the same from any side of the board and in a mirror, and do
+// not tell the colors apart.  Symmetry s transposes the files and ranks if
+// s & SYM_TRANSPOSE, then mirrors the files and the ranks as its bits say,
+// turning the orientations of pieces and the rotations of moves along with
+// the board.  With SYM_COLOR it also swaps the colors and the side to move.
+// Symmetric positions have the same canonical_key, under which the hash
+// table (sym_tt option) and the opening book file them; the move found there
+// is mapped back with the inverse symmetry.  The tablebases only use the
+// color swap, see tablebase.c.
+//
+// https://www.chessprogramming.org/Symmetry
+#define SYM_MIRROR_FILE 1
+#define SYM_MIRROR_RANK 2
+#define SYM_TRANSPOSE   4
+#define SYM_COLOR       8
+#define NUM_SYMMETRIES  16
+
 // -----------------------------------------------------------------------------
 // Position
 // -----------------------------------------------------------------------------
@@ -149,14 +205,39 @@ typedef struct victims_t {
 // https://www.chessprogramming.org/10x12_Board
 
 typedef struct position {
-  piece_t      board[ARR_SIZE];
-  struct position*  history;     // history of position
+  // Fields that every node reads, together in the first cache line
   uint64_t     key;              // hash key
   int          ply;              // Even ply are White, odd are Black
   move_t       last_move;        // move that led to this position
-  victims_t    victims;          // pieces destroyed by shooter
   square_t     kloc[2];          // location of kings
-} position_t;
+  victims_t    victims;          // pieces destroyed by shooter
+  int32_t      psq_score[2];     // running sum of per-Pawn eval terms
+  struct position*  history;     // history of position
+  bitboard_t   bb_pieces[2][2];  // occupancy by [color][ptype - PAWN]
+  bitboard_t   bb_ori[2];        // orientation bit planes (bit 0, bit 1)
+  piece_t      board[ARR_SIZE];
+  laser_path_t laser[2];         // beam fired by each King
+} __attribute__((aligned(64))) position_t;
+
+// Squares a move can change: from, intermediate, to, and the zapped one
+#define MAX_UNDO_SQUARES 4
+
+// What make_move_in_place changed in a position, so that unmake_move can put
+// it back.  A fraction of the size of position_t, which is what copying a
+// position for every move would cost instead.
+typedef struct undo {
+  uint64_t     key;           // fields of the position before the move
+  move_t       last_move;
+  victims_t    victims;
+  square_t     kloc[2];
+  int32_t      psq_score[2];
+  bitboard_t   bb_pieces[2][2];
+  bitboard_t   bb_ori[2];
+  laser_path_t laser[2];
+  int          num_squares;   // squares changed, possibly more than once
+  uint8_t      sq[MAX_UNDO_SQUARES];
+  piece_t      piece[MAX_UNDO_SQUARES];  // contents of sq before the change
+} undo_t;
 
 // -----------------------------------------------------------------------------
 // Function prototypes
@@ -173,13 +254,35 @@ int ori_of(piece_t x);
 void set_ori(piece_t* x, int ori);
 
 void init_zob();
+uint64_t zob_fingerprint();
+uint64_t zob_key_after_move(position_t* p, move_t mv);
 uint64_t compute_zob_key(position_t* p);
 
+square_t sym_square(int s, square_t sq);
+piece_t sym_piece(int s, piece_t x);
+move_t sym_move(int s, move_t mv);
+int sym_inverse(int s);
+// The key of the image of p under s
+uint64_t sym_key(int s, position_t* p);
+// The least key of the images of p, and in *sym the symmetry that gives it
+uint64_t canonical_key(position_t* p, int* sym);
+
 square_t square_of(fil_t f, rnk_t r);
 fil_t fil_of(square_t sq);
 rnk_t rnk_of(square_t sq);
 int square_to_str(square_t sq, char* buf, size_t bufsize);
 
+void init_bitboards(position_t* p);
+bool bitboards_consistent(position_t* p);
+bitboard_t bb_of_square(square_t sq);
+square_t square_of_bb_index(int i);
+bitboard_t bb_neighbors(bitboard_t b);
+bitboard_t bb_ray(square_t from_sq, int bdir, square_t to_sq);
+
+void init_laser_paths(position_t* p);
+bool laser_paths_consistent(position_t* p);
+square_t fire_laser(position_t* p, color_t c);
+
 int dir_of(int i);
 int beam_of(int direction);
 int reflect_of(int beam_dir, int pawn_ori);
@@ -195,10 +298,24 @@ void move_to_str(move_t mv, char* buf, size_t bufsize);
 
 int generate_all(position_t* p, sortable_move_t* sortable_move_list,
                  bool strict);
+int generate_all_mailbox(position_t* p, sortable_move_t* sortable_move_list,
+                         bool strict);
+int generate_all_bitboard(position_t* p, sortable_move_t* sortable_move_list,
+                          bool strict);
+int generate_moves_from(position_t* p, sortable_move_t* sortable_move_list,
+                        color_t color_to_move, bitboard_t from);
+bool is_generated_move(position_t* p, move_t mv);
+int generate_zaps(position_t* p, sortable_move_t* sortable_move_list,
+                  int* exchange);
 int generate_all_with_color(position_t* p, sortable_move_t* sortable_move_list, color_t color_to_move);
-void do_perft(position_t* gme, int depth, int ply);
+void do_perft(position_t* gme, int depth, int ply, bool cross_check,
+              bool divide, int hash_mb);
 void low_level_make_move(position_t* old, position_t* p, move_t mv);
 victims_t make_move(position_t* old, position_t* p, move_t mv);
+void low_level_make_move_in_place(position_t* p, move_t mv, undo_t* u);
+victims_t make_move_in_place(position_t* p, move_t mv, const undo_t* prev,
+                             undo_t* u);
+void unmake_move(position_t* p, const undo_t* u);
 void display(position_t* p);
 
 victims_t KO();
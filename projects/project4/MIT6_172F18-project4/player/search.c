@@ -23,6 +23,7 @@ implementation has been provided for you.
 #include <string.h>
 #include <pthread.h>
 #include <cilk/cilk.h>
+#include <cilk/cilk_api.h>
 #include <cilk/reducer.h>
 
 #define __STDC_FORMAT_MACROS
@@ -33,6 +34,7 @@ implementation has been provided for you.
 #include "./tt.h"
 #include "./util.h"
 #include "./fen.h"
+#include "./simple_mutex.h"
 #include "./tbassert.h"
 
 
@@ -42,6 +44,9 @@ implementation has been provided for you.
 
 #define ABORT_CHECK_PERIOD 0xfff
 
+// Scout nodes shallower than this search their moves serially
+#define PARALLEL_DEPTH 3
+
 // -----------------------------------------------------------------------------
 // READ ONLY settings (see iopt in leiserchess.c)
 // -----------------------------------------------------------------------------
@@ -63,18 +68,130 @@ int DETECT_DRAWS;  // Detect draws by repetition
 // do not set more than 5 ply
 int FUT_DEPTH;     // set to zero for no futilty
 
+int THREADS;       // Number of Cilk workers; 1 searches serially
+
+int ASPIRATION_WINDOW;  // half width of the first window; 0 for the full one
+
+int PROFILE;       // Time eval, move generation and make_move for stats
+
 
 // Declare the two main search functions.
-static score_t searchPV(searchNode* node, int depth,
-                        uint64_t* node_count_serial);
-static score_t scout_search(searchNode* node, int depth,
-                            uint64_t* node_count_serial);
+static score_t searchPV(searchNode* node, int depth);
+static score_t scout_search(searchNode* node, int depth);
 
 // Include common search functions
 #include "./search_globals.c"
 #include "./search_common.c"
 #include "./search_scout.c"
 
+// Restarts the Cilk runtime with n workers, each with its own search context.
+// Must not be called while a search is running.
+void init_search_threads(int n) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%d", n);
+  __cilkrts_end_cilk();
+  if (__cilkrts_set_param("nworkers", buf) != 0) {
+    fprintf(stderr, "Could not set the number of workers to %d\n", n);
+  }
+  init_search_contexts(n);
+}
+
+// Totals behind the stats command, updated by searchRoot.  analyze runs it in
+// several workers at once, so they are added to atomically.
+static uint64_t search_cycles;  // spent in searchRoot
+static uint64_t iteration_nodes[MAX_PLY_IN_SEARCH];  // nodes by root depth
+
+void reset_search_stats() {
+  for (int w = 0; w < num_contexts; w++) {
+    memset(&contexts[w].stats, 0, sizeof(contexts[w].stats));
+  }
+  simple_mutex_reset_stats();
+  search_cycles = 0;
+  memset(iteration_nodes, 0, sizeof(iteration_nodes));
+}
+
+// Returns 100 * x / y, or 0 if y is 0.
+static double percent(uint64_t x, uint64_t y) {
+  return y ? 100.0 * x / y : 0.0;
+}
+
+void print_search_stats(FILE* out) {
+  searchStats stats;
+  sum_search_stats(&stats);
+
+  fprintf(out, "info string nodes: %" PRIu64 ", %.1f%% in quiescence\n",
+          stats.nodes, percent(stats.qnodes, stats.nodes));
+  fprintf(out, "info string quiescence: %" PRIu64 " zap lists, %.2f zaps"
+          " per list\n", stats.zap_lists,
+          stats.zap_lists ? (double) stats.zaps / stats.zap_lists : 0.0);
+  if (num_contexts > 1) {
+    fprintf(out, "info string   by worker:");
+    for (int w = 0; w < num_contexts; w++) {
+      fprintf(out, " %.1f%%", percent(contexts[w].stats.nodes, stats.nodes));
+    }
+    fprintf(out, "\n");
+  }
+
+  // The effective branching factor is the growth of the tree from one
+  // iteration to the next.
+  int d = MAX_PLY_IN_SEARCH - 1;
+  while (d > 1 && (iteration_nodes[d] == 0 || iteration_nodes[d - 1] == 0)) {
+    d--;
+  }
+  fprintf(out, "info string branching factor: %.2f moves per node searched,"
+          " %.2f effective at depth %d\n",
+          stats.stage_nodes ? (double) stats.nodes / stats.stage_nodes : 0.0,
+          iteration_nodes[d - 1] ? (double) iteration_nodes[d] /
+                                   iteration_nodes[d - 1] : 0.0, d);
+
+  fprintf(out, "info string hash table: %" PRIu64 " probes, %.1f%% hits,"
+          " %.1f%% cutoffs, %" PRIu64 " stores, %.1f%% collisions\n",
+          stats.tt_probes, percent(stats.tt_hits, stats.tt_probes),
+          percent(stats.tt_cutoffs, stats.tt_probes), stats.tt_stores,
+          percent(stats.tt_collisions, stats.tt_stores));
+
+  uint64_t cutoffs = 0;
+  for (int i = 0; i < CUTOFF_BUCKETS; i++) {
+    cutoffs += stats.cutoff_index[i];
+  }
+  fprintf(out, "info string cutoffs: %" PRIu64 ", by move", cutoffs);
+  for (int i = 0; i < CUTOFF_BUCKETS; i++) {
+    fprintf(out, " %d%s %.1f%%", i + 1, i == CUTOFF_BUCKETS - 1 ? "+" : "",
+            percent(stats.cutoff_index[i], cutoffs));
+  }
+  fprintf(out, "\n");
+
+  fprintf(out, "info string pruning: %" PRIu64 " null move margin, %" PRIu64
+          " futility, %" PRIu64 " late move reductions (%.1f%% searched"
+          " again)\n", stats.margin_prunes, stats.futility_prunes,
+          stats.lmr_reductions,
+          percent(stats.lmr_researches, stats.lmr_reductions));
+
+  print_move_stage_stats(out, &stats);
+
+  simple_mutex_stats_t locks;
+  simple_mutex_get_stats(&locks);
+  fprintf(out, "info string locks: %" PRIu64 " acquisitions, %" PRIu64
+          " (%.2f%%) contended, %" PRIu64 " sleeps, %.0f cycles per contended"
+          " acquisition\n", locks.acquisitions, locks.contended,
+          percent(locks.contended, locks.acquisitions), locks.sleeps,
+          locks.contended ? (double) locks.contention_cycles / locks.contended
+                          : 0.0);
+
+  if (PROFILE) {
+    // The workers' cycles are a share of the time all of them spent in
+    // searchRoot.
+    uint64_t total = search_cycles * num_contexts;
+    fprintf(out, "info string time: eval %.1f%%, move generation %.1f%%,"
+            " make_move %.1f%% of the search\n",
+            percent(stats.cycles[PROFILED_EVAL], total),
+            percent(stats.cycles[PROFILED_GEN], total),
+            percent(stats.cycles[PROFILED_MAKE], total));
+  } else {
+    fprintf(out, "info string time: set the profile option to 1 to measure\n");
+  }
+}
+
 // Initializes a PV (principle variation node)
 // https://www.chessprogramming.org/Node_Types#PV-Nodes
 static void initialize_pv_node(searchNode* node, int depth) {
@@ -86,7 +203,7 @@ static void initialize_pv_node(searchNode* node, int depth) {
   node->depth = depth;
   node->legal_move_count = 0;
   node->ply = node->parent->ply + 1;
-  node->fake_color_to_move = color_to_move_of(&(node->position));
+  node->fake_color_to_move = color_to_move_of(node->position);
   // point of view = 1 for white, -1 for black
   node->pov = 1 - node->fake_color_to_move * 2;
   node->quiescence = (depth <= 0);
@@ -98,7 +215,7 @@ static void initialize_pv_node(searchNode* node, int depth) {
 // Perform a Principle Variation Search
 //
 // https://www.chessprogramming.org/Principal_Variation_Search
-static score_t searchPV(searchNode* node, int depth, uint64_t* node_count_serial) {
+static score_t searchPV(searchNode* node, int depth) {
   // Initialize the searchNode data structure.
   initialize_pv_node(node, depth);
 
@@ -118,45 +235,41 @@ static score_t searchPV(searchNode* node, int depth, uint64_t* node_count_serial
     }
   }
 
-  // Get the killer moves at this node.
-  move_t killer_a = killer[KMT(node->ply, 0)];
-  move_t killer_b = killer[KMT(node->ply, 1)];
-
-
-  // sortable_move_t move_list
+  // moveList list
   //
   // Contains a list of possible moves at this node. These moves are "sortable"
   //   and can be compared as integers. This is accomplished by using high-order
-  //   bits to store a sort key.
+  //   bits to store a sort key.  The list starts out with just the hash move
+  //   and the killers; has_move generates the rest when they are used up.
   //
   // Keep track of the number of moves that we have considered at this node.
-  //   After we finish searching moves at this node the move_list array will
+  //   After we finish searching moves at this node the list.moves array will
   //   be organized in the following way:
   //
   //   m0, m1, ... , m_k-1, m_k, ... , m_N-1
   //
-  //  where k = num_moves_tried, and N = num_of_moves
+  //  where k = num_moves_tried, and N = list.count
   //
   //  This will allow us to update the best_move_history table easily by
-  //  scanning move_list from index 0 to k such that we update the table
+  //  scanning list.moves from index 0 to k such that we update the table
   //  only for moves that we actually considered at this node.
-  sortable_move_t move_list[MAX_NUM_MOVES];
-  int num_of_moves = get_sortable_move_list(node, move_list, hash_table_move);
+  moveList list;
+  init_move_list(node, &list, hash_table_move);
   int num_moves_tried = 0;
+  bool cutoff = false;
 
   // Start searching moves.
-  for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    // Insertion sort the move list.
-    sort_insertion(move_list, num_of_moves, mv_index);
-
-    move_t mv = get_move(move_list[mv_index]);
+  for (int mv_index = 0; has_move(node, &list, mv_index); mv_index++) {
+    move_t mv = get_move(list.moves[mv_index]);
 
     num_moves_tried++;
-    (*node_count_serial)++;
+    searchStats* stats = &worker_context()->stats;
+    stats->nodes++;
+    stats->qnodes += node->quiescence;
 
-    moveEvaluationResult result = evaluateMove(node, mv, killer_a, killer_b,
-                                               SEARCH_PV,
-                                               node_count_serial);
+    moveEvaluationResult result = evaluateMove(node, node->position, mv,
+                                               list.killer_a, list.killer_b,
+                                               SEARCH_PV);
 
     if (result.type == MOVE_ILLEGAL || result.type == MOVE_IGNORE) {
       continue;
@@ -173,15 +286,17 @@ static score_t searchPV(searchNode* node, int depth, uint64_t* node_count_serial
       return 0;
     }
 
-    bool cutoff = search_process_score(node, mv, mv_index, &result, SEARCH_PV);
+    cutoff = search_process_score(node, mv, mv_index, &result, SEARCH_PV);
     if (cutoff) {
       break;
     }
   }
 
+  count_move_stage(&list, num_moves_tried, cutoff, node->best_move_index);
+
   if (node->quiescence == false) {
-    update_best_move_history(&(node->position), node->best_move_index,
-                             move_list, num_moves_tried);
+    update_best_move_history(node->position, node->best_move_index,
+                             list.moves, num_moves_tried);
   }
 
   tbassert(abs(node->best_score) != -INF, "best_score = %d\n",
@@ -190,7 +305,7 @@ static score_t searchPV(searchNode* node, int depth, uint64_t* node_count_serial
   // Update the transposition table.
   //
   // Note: This function reads node->best_score, node->orig_alpha,
-  //   node->position.key, node->depth, node->ply, node->beta,
+  //   node->position->key, node->depth, node->ply, node->beta,
   //   node->alpha, node->subpv
   update_transposition_table(node);
 
@@ -209,144 +324,331 @@ static void initialize_root_node(searchNode* node, score_t alpha, score_t beta,
   node->beta = beta;
   node->depth = depth;
   node->ply = ply;
-  node->position = *p;
-  node->fake_color_to_move = color_to_move_of(&(node->position));
+  node->position = p;
+  node->fake_color_to_move = color_to_move_of(node->position);
   node->best_score = -INF;
   node->pov = 1 - node->fake_color_to_move * 2;  // pov = 1 for White, -1 for Black
+  node->legal_move_count = 0;
   node->abort = false;
 }
 
-score_t searchRoot(position_t* p, score_t alpha, score_t beta, int depth,
-                   int ply, move_t* pv, uint64_t* node_count_serial,
-                   FILE* OUT) {
-  static int num_of_moves = 0;  // number of moves in list
-  // hopefully, more than we will need
-  static sortable_move_t move_list[MAX_NUM_MOVES];
+// Makes root move mv in next_node->position and scores it into *score.  The
+// eldest move gets a PV search; the others get a scout search, repeated as a
+// PV search if they beat alpha.  Returns false if mv is not legal.
+static bool score_root_move(searchNode* root, searchNode* next_node, move_t mv,
+                            bool eldest, score_t* score) {
+  position_t* p = next_node->position;
+  victims_t x = make_move_in_place(p, mv, NULL, &(next_node->undo));
+
+  if (is_KO(x)) {
+    unmake_move(p, &(next_node->undo));
+    return false;
+  }
 
-  if (depth == 1) {
-    // we are at depth 1; generate all possible moves
-    num_of_moves = generate_all(p, move_list, false);
-    // shuffle the list of moves
-    for (int i = 0; i < num_of_moves; i++) {
-      int r = myrand() % num_of_moves;
-      sortable_move_t tmp = move_list[i];
-      move_list[i] = move_list[r];
-      move_list[r] = tmp;
+  if (is_end_game_position(p, root->pov, root->ply)) {
+    *score = get_end_game_score(p, root->pov, root->ply);
+    next_node->subpv[0] = 0;
+  } else if (is_repeated(next_node, root->ply)) {
+    *score = get_draw_score(next_node, root->ply);
+    next_node->subpv[0] = 0;
+  } else if (eldest || root->depth == 1) {
+    // We guess that the first move is the principle variation
+    *score = -searchPV(next_node, root->depth - 1);
+  } else {
+    *score = -scout_search(next_node, root->depth - 1);
+
+    // If its score exceeds the current best score,
+    if (!abortf && *score > root->alpha) {
+      *score = -searchPV(next_node, root->depth - 1);
     }
   }
 
-  searchNode rootNode;
-  rootNode.parent = NULL;
-  initialize_root_node(&rootNode, alpha, beta, depth, ply, p);
-
+  unmake_move(p, &(next_node->undo));
+  return true;
+}
 
-  assert(rootNode.best_score == alpha);  // initial conditions
+// Takes score for root move mv at mv_index as the best so far if it beats
+// alpha: mv becomes the head of pv, gets reported to OUT unless it is NULL,
+// and moves to the front of root_moves.  Returns true if the score reaches
+// beta.
+static bool record_root_score(searchNode* root, rootMoveList* root_moves,
+                              int mv_index, move_t mv, score_t score,
+                              move_t* subpv, move_t* pv, uint64_t nodes,
+                              FILE* OUT) {
+  if (score > root->best_score) {
+    root->best_score = score;
+  }
 
-  searchNode next_node;
-  next_node.subpv[0] = 0;
-  next_node.parent = &rootNode;
+  // Normal alpha-beta logic: if the current score is better than what the
+  // maximizer has been able to get so far, take that new value.  Scores that
+  // do not beat alpha are only bounds when the window was narrowed, so they
+  // leave the principal variation alone.
+  if (score > root->alpha) {
+    root->alpha = score;
 
-  score_t score;
+    pv[0] = mv;
+    memcpy(pv + 1, subpv, sizeof(move_t) * (MAX_PLY_IN_SEARCH - 1));
+    pv[MAX_PLY_IN_SEARCH - 1] = 0;
 
-  for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    move_t mv = get_move(move_list[mv_index]);
+    // Print out based on UCI (universal chess interface)
+    if (OUT != NULL) {
+      double et = elapsed_time();
+      char   pvbuf[MAX_PLY_IN_SEARCH * MAX_CHARS_IN_MOVE];
+      getPV(pv, pvbuf, MAX_PLY_IN_SEARCH * MAX_CHARS_IN_MOVE);
+      if (et < 0.00001) {
+        et = 0.00001;  // hack so that we don't divide by 0
+      }
 
-    if (TRACE_MOVES) {
-      print_move_info(mv, ply);
+      uint64_t nps = 1000 * nodes / et;
+      fprintf(OUT, "info depth %d move_no %d time (microsec) %d nodes %" PRIu64
+              " nps %" PRIu64 " threads %d\n",
+              root->depth, mv_index + 1, (int)(et * 1000), nodes, nps, THREADS);
+      fprintf(OUT, "info score cp %d pv %s\n", score, pvbuf);
     }
 
-    (*node_count_serial)++;
+    // Slide this move to the front of the move list.  Brothers searched in
+    // parallel may already have moved it from mv_index.
+    int j = 0;
+    while (j < root_moves->count && get_move(root_moves->moves[j]) != mv) {
+      j++;
+    }
+    for (; j > 0; j--) {
+      root_moves->moves[j] = root_moves->moves[j - 1];
+    }
+    root_moves->moves[0] = mv;
+  }
 
-    // make the move.
-    victims_t x = make_move(&(rootNode.position), &(next_node.position), mv);
+  // score >= beta is the beta cutoff condition
+  return score >= root->beta;
+}
 
-    if (is_KO(x)) {
-      continue;  // not a legal move
-    }
+// Searches root move mv_index of moves, making it in p.  Returns true if it
+// produced a cutoff, which is also recorded in root->abort so that the root
+// moves still being searched stop early.  Like scout_search_move, it only
+// updates root while holding root_mutex.  nodes_offset is what to add to
+// search_nodes() to get the node count of the whole search.
+static bool search_root_move(searchNode* root, rootMoveList* root_moves,
+                             sortable_move_t* moves, int mv_index,
+                             position_t* p, simple_mutex_t* root_mutex,
+                             move_t* pv, uint64_t nodes_offset, FILE* OUT) {
+  move_t mv = get_move(moves[mv_index]);
+
+  if (TRACE_MOVES) {
+    print_move_info(mv, root->ply);
+  }
 
-    if (is_end_game_position(&(next_node.position), rootNode.pov, rootNode.ply)) {
-      score = get_end_game_score(&(next_node.position), rootNode.pov, rootNode.ply);
-      next_node.subpv[0] = 0;
-      goto scored;
-    }
+  worker_context()->stats.nodes++;
 
-    if (is_repeated(&(next_node.position), rootNode.ply)) {
-      score = get_draw_score(&(next_node.position), rootNode.ply);
-      next_node.subpv[0] = 0;
-      goto scored;
-    }
+  searchNode next_node;
+  next_node.parent = root;
+  next_node.position = p;
+  next_node.subpv[0] = 0;
 
-    if (mv_index == 0 || rootNode.depth == 1) {
-      // We guess that the first move is the principle variation
-      score = -searchPV(&next_node, rootNode.depth - 1, node_count_serial);
+  score_t score;
+  if (!score_root_move(root, &next_node, mv, mv_index == 0, &score) ||
+      abortf || root->abort) {
+    return false;
+  }
 
-      // Check if we should abort due to time control.
-      if (abortf) {
-        return 0;
-      }
-    } else {
-      score = -scout_search(&next_node, rootNode.depth - 1, node_count_serial);
+  simple_acquire(root_mutex);
+  root->legal_move_count++;
+  bool cutoff = !root->abort &&
+      record_root_score(root, root_moves, mv_index, mv, score,
+                        next_node.subpv, pv, nodes_offset + search_nodes(),
+                        OUT);
+  if (cutoff) {
+    root->abort = true;
+  }
+  simple_release(root_mutex);
+  return cutoff;
+}
 
-      // Check if we should abort due to time control.
-      if (abortf) {
-        return 0;
-      }
+// Searches the moves of root_moves, as searchRoot does once they are
+// generated.
+static score_t search_root_moves(position_t* p, score_t alpha, score_t beta,
+                                 int depth, int ply, rootMoveList* root_moves,
+                                 move_t* pv, uint64_t* node_count_serial,
+                                 FILE* OUT) {
+  // The moves are made in place in a copy of p, so that p itself stays put.
+  position_t root_position = *p;
+  searchNode rootNode;
+  rootNode.parent = NULL;
+  initialize_root_node(&rootNode, alpha, beta, depth, ply, &root_position);
+
+  // Bring the running evaluation sums in line with the current eval options.
+  init_incremental_eval(rootNode.position);
+
+  // The moves are searched in the order they had when this iteration
+  // started, while record_root_score reorders root_moves for the next one.
+  int num_of_moves = root_moves->count;
+  sortable_move_t moves[MAX_NUM_MOVES];
+  memcpy(moves, root_moves->moves, sizeof(sortable_move_t) * num_of_moves);
+
+  simple_mutex_t root_mutex;
+  init_simple_mutex(&root_mutex);
+
+  // Every worker counts its nodes in its own context; those of this iteration
+  // are added to *node_count_serial once it is over.
+  uint64_t start = read_cycle_counter();
+  uint64_t nodes_start = search_nodes();
+  uint64_t nodes_offset = *node_count_serial - nodes_start;
+  merge_best_move_history();
+
+  // Principal variation splitting: the first legal move, most likely the
+  // best, is searched by itself to establish alpha.  The other moves are then
+  // searched in parallel with a null window, and whichever beats alpha is
+  // searched again with the full one.
+  //
+  // https://www.chessprogramming.org/Parallel_Search#PrincipalVariationSplitting
+  bool parallel = THREADS > 1 && depth >= PARALLEL_DEPTH;
+  bool cutoff = false;
+  int mv_index = 0;
+  move_t first_move = 0;    // the first legal move, searched by itself
+  uint64_t first_nodes = 0;
+
+  while (mv_index < num_of_moves && !cutoff && !abortf &&
+         !(parallel && rootNode.legal_move_count > 0)) {
+    cutoff = search_root_move(&rootNode, root_moves, moves, mv_index,
+                              rootNode.position, &root_mutex, pv,
+                              nodes_offset, OUT);
+    if (first_move == 0 && rootNode.legal_move_count > 0) {
+      first_move = get_move(moves[mv_index]);
+      first_nodes = search_nodes() - nodes_start;
+    }
+    mv_index++;
+  }
 
-      // If its score exceeds the current best score,
-      if (score > rootNode.alpha) {
-        score = -searchPV(&next_node, rootNode.depth - 1, node_count_serial);
-        // Check if we should abort due to time control.
-        if (abortf) {
-          return 0;
-        }
+  if (parallel && !cutoff && !abortf && mv_index < num_of_moves) {
+    cilk_for (int i = mv_index; i < num_of_moves; i++) {
+      if (!rootNode.abort && !abortf) {
+        // Root moves searched at the same time each need their own position.
+        position_t np = root_position;
+        search_root_move(&rootNode, root_moves, moves, i, &np, &root_mutex,
+                         pv, nodes_offset, OUT);
       }
     }
+  }
 
-  scored:
-    // only valid for the root node:
-    tbassert((score > rootNode.best_score) == (score > rootNode.alpha),
-             "score = %d, best = %d, alpha = %d\n", score, rootNode.best_score, rootNode.alpha);
+  uint64_t nodes = search_nodes() - nodes_start;
+  *node_count_serial += nodes;
+  root_moves->nodes = nodes;
+  root_moves->best_nodes = (first_move != 0 && pv[0] == first_move) ?
+                           first_nodes : 0;
+  __atomic_fetch_add(&search_cycles, read_cycle_counter() - start,
+                     __ATOMIC_RELAXED);
+  if (depth < MAX_PLY_IN_SEARCH) {
+    __atomic_fetch_add(&iteration_nodes[depth], nodes, __ATOMIC_RELAXED);
+  }
 
-    if (score > rootNode.best_score) {
-      tbassert(score > rootNode.alpha, "score: %d, alpha: %d\n", score, rootNode.alpha);
+  // Check if we should abort due to time control.
+  if (abortf) {
+    return 0;
+  }
 
-      rootNode.best_score = score;
-      pv[0] = mv;
-      memcpy(pv + 1, next_node.subpv, sizeof(move_t) * (MAX_PLY_IN_SEARCH - 1));
-      pv[MAX_PLY_IN_SEARCH - 1] = 0;
+  return rootNode.best_score;
+}
 
-      // Print out based on UCI (universal chess interface)
-      double et = elapsed_time();
-      char   pvbuf[MAX_PLY_IN_SEARCH * MAX_CHARS_IN_MOVE];
-      getPV(pv, pvbuf, MAX_PLY_IN_SEARCH * MAX_CHARS_IN_MOVE);
-      if (et < 0.00001) {
-        et = 0.00001;  // hack so that we don't divide by 0
+score_t searchRoot(position_t* p, score_t alpha, score_t beta, int depth,
+                   int ply, rootMoveList* root_moves, move_t* pv,
+                   uint64_t* node_count_serial, FILE* OUT) {
+  if (depth == 1) {
+    // we are at depth 1; generate all possible moves
+    root_moves->count = generate_all(p, root_moves->moves, false);
+    root_moves->legal_count = 0;
+    position_t np;
+    for (int i = 0; i < root_moves->count; i++) {
+      if (!is_KO(make_move(p, &np, get_move(root_moves->moves[i])))) {
+        root_moves->legal_count++;
       }
+    }
+    // shuffle the list of moves, under a lock as the random number generator
+    // is shared by the searches of analyze
+    static simple_mutex_t rng_mutex = 0;
+    simple_acquire(&rng_mutex);
+    for (int i = 0; i < root_moves->count; i++) {
+      int r = myrand() % root_moves->count;
+      sortable_move_t tmp = root_moves->moves[i];
+      root_moves->moves[i] = root_moves->moves[r];
+      root_moves->moves[r] = tmp;
+    }
+    simple_release(&rng_mutex);
+  }
 
-      uint64_t nps = 1000 * *node_count_serial / et;
-      fprintf(OUT, "info depth %d move_no %d time (microsec) %d nodes %" PRIu64
-              " nps %" PRIu64 "\n",
-              depth, mv_index + 1, (int)(et * 1000), *node_count_serial, nps);
-      fprintf(OUT, "info score cp %d pv %s\n", score, pvbuf);
+  return search_root_moves(p, alpha, beta, depth, ply, root_moves, pv,
+                           node_count_serial, OUT);
+}
 
-      // Slide this move to the front of the move list
-      for (int j = mv_index; j > 0; j--) {
-        move_list[j] = move_list[j - 1];
-      }
-      move_list[0] = mv;
+// Searches p to depth with a window of ASPIRATION_WINDOW on each side of
+// guess, the score of the previous iteration.  If the score falls outside,
+// the search is repeated with the window widened on that side, twice as much
+// each time.  Depth 1, or an ASPIRATION_WINDOW of 0, uses the full window.
+//
+// https://www.chessprogramming.org/Aspiration_Windows
+score_t searchAspiration(position_t* p, score_t guess, int depth, int ply,
+                         rootMoveList* root_moves, move_t* pv,
+                         uint64_t* node_count_serial, FILE* OUT) {
+  if (depth == 1 || ASPIRATION_WINDOW == 0) {
+    return searchRoot(p, -INF, INF, depth, ply, root_moves, pv,
+                      node_count_serial, OUT);
+  }
+
+  int delta = ASPIRATION_WINDOW;
+  int alpha = (guess - delta > -INF) ? guess - delta : -INF;
+  int beta = (guess + delta < INF) ? guess + delta : INF;
+
+  while (true) {
+    score_t score = searchRoot(p, alpha, beta, depth, ply, root_moves, pv,
+                               node_count_serial, OUT);
+    if (abortf) {
+      return score;
     }
 
-    // Normal alpha-beta logic: if the current score is better than what the
-    // maximizer has been able to get so far, take that new value.  Likewise,
-    // score >= beta is the beta cutoff condition
-    if (score > rootNode.alpha) {
-      rootNode.alpha = score;
+    if (score <= alpha && alpha > -INF) {
+      alpha = (alpha - delta > -INF) ? alpha - delta : -INF;
+    } else if (score >= beta && beta < INF) {
+      beta = (beta + delta < INF) ? beta + delta : INF;
+    } else {
+      return score;
     }
-    if (score >= rootNode.beta) {
-      tbassert(0, "score: %d, beta: %d\n", score, rootNode.beta);
+    delta *= 2;
+  }
+}
+
+// Multi-PV: the best move is searched by searchAspiration with guesses[0],
+// then the k-th best by a full window search of the moves left once the k
+// before it are taken out.  pvs[k] and guesses[k] get line k, and the lines
+// move to the front of root_moves in order, which is where the next
+// iteration searches them first.  Returns the number of lines found, fewer
+// than n if the search is aborted or runs out of legal moves.  Only the best
+// line reports its root moves to OUT, so that the last plain score there is
+// that of the move played; the caller reports the others as multipv lines.
+//
+// https://www.chessprogramming.org/Multi-PV
+int searchMultiPV(position_t* p, score_t* guesses, int n, int depth, int ply,
+                  rootMoveList* root_moves, move_t pvs[][MAX_PLY_IN_SEARCH],
+                  uint64_t* node_count_serial, FILE* OUT) {
+  guesses[0] = searchAspiration(p, guesses[0], depth, ply, root_moves, pvs[0],
+                                node_count_serial, OUT);
+  if (abortf) {
+    return 0;
+  }
+
+  int lines = 1;
+  rootMoveList rest;
+  while (lines < n && lines < root_moves->count) {
+    rest.count = root_moves->count - lines;
+    memcpy(rest.moves, root_moves->moves + lines,
+           sizeof(sortable_move_t) * rest.count);
+    pvs[lines][0] = 0;
+    score_t score = search_root_moves(p, -INF, INF, depth, ply, &rest,
+                                      pvs[lines], node_count_serial, NULL);
+    if (abortf || pvs[lines][0] == 0) {
       break;
     }
+    memcpy(root_moves->moves + lines, rest.moves,
+           sizeof(sortable_move_t) * rest.count);
+    guesses[lines] = score;
+    lines++;
   }
-
-  return rootNode.best_score;
+  return lines;
 }
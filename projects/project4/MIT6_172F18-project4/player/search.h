@@ -58,21 +58,51 @@ typedef struct searchNode {
   bool abort;
   score_t best_score;
   int best_move_index;
-  position_t position;
+  // The position is made in place in the one of the parent, unless brothers
+  // are searched in parallel, in which case each gets a copy.  undo takes the
+  // move from the parent back.
+  position_t* position;
+  undo_t undo;
   move_t subpv[MAX_PLY_IN_SEARCH];
 } searchNode;
 
+// The moves of the root.  searchRoot generates them at depth 1 and moves the
+// best one to the front, so the list lives for a whole iterative deepening.
+// It also leaves there how its search went, for the time manager.
+typedef struct rootMoveList {
+  int count;
+  int legal_count;      // of those, the moves that the Ko rule allows
+  sortable_move_t moves[MAX_NUM_MOVES];
+  uint64_t nodes;       // searched by the last searchRoot
+  uint64_t best_nodes;  // of those, under the best move if it was searched
+                        // first, else 0
+} rootMoveList;
+
 
 void init_tics();
 void init_abort_timer(double goal_time);
+// Moves the deadline of the running search as if it had started now; safe to
+// call from another thread.
+void restart_abort_timer(double goal_time);
 double elapsed_time();
 bool should_abort();
 void reset_abort();
 void init_best_move_history();
+void init_killers();
+void init_search_threads(int n);
+void reset_search_stats();
+void print_search_stats(FILE* out);
 move_t get_move(sortable_move_t sortable_mv);
+void getPV(move_t* pv, char* buf, size_t bufsize);
 score_t searchRoot(position_t* p, score_t alpha, score_t beta, int depth,
-                   int ply, move_t* pv, uint64_t* node_count_serial,
-                   FILE* OUT);
+                   int ply, rootMoveList* root_moves, move_t* pv,
+                   uint64_t* node_count_serial, FILE* OUT);
+score_t searchAspiration(position_t* p, score_t guess, int depth, int ply,
+                         rootMoveList* root_moves, move_t* pv,
+                         uint64_t* node_count_serial, FILE* OUT);
+int searchMultiPV(position_t* p, score_t* guesses, int n, int depth, int ply,
+                  rootMoveList* root_moves, move_t pvs[][MAX_PLY_IN_SEARCH],
+                  uint64_t* node_count_serial, FILE* OUT);
 
 
 #endif  // SEARCH_H
@@ -1,10 +1,12 @@
 // Copyright (c) 2015 MIT License by 6.172 Staff
 
-// tic counter for how often we should check for abort
-static int     tics = 0;
 static double  sstart;    // start time of a search in milliseconds
-static double  timeout;   // time elapsed before abort
-static bool    abortf = false;  // abort flag for search
+// Time at which the search is aborted.  Workers read it while it may be moved,
+// so it is only accessed atomically.
+static double  deadline;
+// Abort flag for search, read at every node and set by whichever worker finds
+// the deadline passed.
+static volatile bool abortf = false;
 
 static score_t fmarg[10] = {
   0, PAWN_VALUE / 2, PAWN_VALUE, (PAWN_VALUE * 5) / 2, (PAWN_VALUE * 9) / 2,
@@ -32,6 +34,17 @@ typedef struct leafEvalResult {
   int hash_table_move;
 } leafEvalResult;
 
+// Moves of a node, filled in stage by stage (see init_move_list)
+typedef struct moveList {
+  sortable_move_t moves[MAX_NUM_MOVES];
+  int count;              // moves in the list so far
+  int num_special;        // the hash move and killers at the front
+  bool complete;          // whether the other moves have been generated
+  move_t hash_table_move;
+  move_t killer_a;
+  move_t killer_b;
+} moveList;
+
 
 typedef uint32_t sort_key_t;
 static const uint64_t SORT_MASK = (1ULL << 32) - 1;
@@ -53,8 +66,13 @@ static void set_sort_key(sortable_move_t* mv, sort_key_t key) {
 
 void init_abort_timer(double goal_time) {
   sstart = milliseconds();
+  restart_abort_timer(goal_time);
+}
+
+void restart_abort_timer(double goal_time) {
   // don't go over any more than 3 times the goal
-  timeout = sstart + goal_time * 3.0;
+  double d = milliseconds() + goal_time * 3.0;
+  __atomic_store(&deadline, &d, __ATOMIC_RELAXED);
 }
 
 double elapsed_time() {
@@ -70,26 +88,58 @@ void reset_abort() {
 }
 
 void init_tics() {
-  tics = 0;
+  for (int w = 0; w < num_contexts; w++) {
+    contexts[w].tics = 0;
+  }
 }
 
 move_t get_move(sortable_move_t sortable_mv) {
   return (move_t)(sortable_mv & MOVE_MASK);
 }
 
-static score_t get_draw_score(position_t* p, int ply) {
-  position_t* x = p->history;
-  uint64_t cur = p->key;
+// The positions before a search node, latest first.  The positions of the
+// nodes above it share one position_t that is made in place, so they are
+// described by the undo records of their children.  Beyond the root node come
+// the positions of the game, linked by their history pointers.
+typedef struct {
+  searchNode* node;  // the current position, up to the root node
+  position_t* game;  // the current position, beyond the root node
+  uint64_t    key;
+  victims_t   victims;
+} ancestor_t;
+
+// Moves a to the position before its current one, starting from node.
+static void ancestor_back(ancestor_t* a) {
+  if (a->node != NULL && a->node->parent != NULL) {
+    a->key = a->node->undo.key;
+    a->victims = a->node->undo.victims;
+    a->node = a->node->parent;
+    return;
+  }
+  if (a->node != NULL) {  // the root node, which is in the game
+    a->game = a->node->position->history;
+    a->node = NULL;
+  } else {
+    a->game = a->game->history;
+  }
+  a->key = a->game->key;
+  a->victims = a->game->victims;
+}
+
+static score_t get_draw_score(searchNode* node, int ply) {
+  ancestor_t x = { node, NULL, 0, {0, 0} };
+  ancestor_back(&x);
+  uint64_t cur = node->position->key;
   score_t score;
   while (true) {
-    if (!zero_victims(x->victims)) {
+    if (!zero_victims(x.victims)) {
       break;  // cannot be a repetition
     }
-    x = x->history;
-    if (!zero_victims(x->victims)) {
+    ancestor_back(&x);
+    if (!zero_victims(x.victims)) {
       break;  // cannot be a repetition
     }
-    if (x->key == cur) {  // is a repetition
+    if (x.key == cur) {  // is a repetition
       if (ply & 1) {
         score = -DRAW;
       } else {
@@ -97,7 +147,7 @@ static score_t get_draw_score(position_t* p, int ply) {
       }
       return score;
     }
-    x = x->history;
+    ancestor_back(&x);
   }
   assert(false);  // This should not occur.
   return (score_t) 0;
@@ -106,31 +156,32 @@ static score_t get_draw_score(position_t* p, int ply) {
 
 
 // Detect move repetition
-static bool is_repeated(position_t* p, int ply) {
+static bool is_repeated(searchNode* node, int ply) {
   if (!DETECT_DRAWS) {
     return false;  // no draw detected
   }
 
-  position_t* x = p->history;
-  uint64_t cur = p->key;
+  ancestor_t x = { node, NULL, 0, {0, 0} };
+  ancestor_back(&x);
+  uint64_t cur = node->position->key;
 
   while (true) {
-    if (!zero_victims(x->victims)) {
+    if (!zero_victims(x.victims)) {
       break;  // cannot be a repetition
     }
-    x = x->history;
-    if (!zero_victims(x->victims)) {
+    ancestor_back(&x);
+    if (!zero_victims(x.victims)) {
       break;  // cannot be a repetition
     }
-    if (x->key == cur) {  // is a repetition
+    if (x.key == cur) {  // is a repetition
       return true;
     }
-    x = x->history;
+    ancestor_back(&x);
   }
   return false;
 }
 
-static void getPV(move_t* pv, char* buf, size_t bufsize) {
+void getPV(move_t* pv, char* buf, size_t bufsize) {
   buf[0] = 0;
 
   for (int i = 0; i < (MAX_PLY_IN_SEARCH - 1) && pv[i] != 0; i++) {
@@ -166,20 +217,27 @@ leafEvalResult evaluate_as_leaf(searchNode* node, searchType_t type) {
   // get transposition table record if available.
   //
   // https://www.chessprogramming.org/Transposition_Table
-  ttRec_t* rec = tt_hashtable_get(node->position.key);
+  searchStats* stats = &worker_context()->stats;
+  stats->tt_probes++;
+  int sym;
+  ttRec_t* rec = tt_hashtable_get(tt_key_of(node->position, &sym));
   if (rec) {
+    stats->tt_hits++;
     if (type == SEARCH_SCOUT && tt_is_usable(rec, node->depth, node->beta)) {
+      stats->tt_cutoffs++;
       result.type = MOVE_EVALUATED;
       result.score = tt_adjust_score_from_hashtable(rec, node->ply);
       return result;
     }
-    result.hash_table_move = tt_move_of(rec);
+    result.hash_table_move = sym_move(sym_inverse(sym), tt_move_of(rec));
   }
 
   // stand pat (having-the-move) bonus
   //
   // https://www.chessprogramming.org/Quiescence_Search#Standing_Pat
-  score_t sps = eval(&(node->position), false) + HMB;
+  uint64_t start = profile_start();
+  score_t sps = eval_incremental(node->position) + HMB;
+  profile_stop(PROFILED_EVAL, start);
   bool quiescence = (node->depth <= 0);  // are we in quiescence?
   result.should_enter_quiescence = quiescence;
   if (quiescence) {
@@ -194,11 +252,13 @@ leafEvalResult evaluate_as_leaf(searchNode* node, searchType_t type) {
   if (type == SEARCH_SCOUT && USE_NMM) {
     if (node->depth <= 2) {
       if (node->depth == 1 && sps >= node->beta + 3 * PAWN_VALUE) {
+        stats->margin_prunes++;
         result.type = MOVE_EVALUATED;
         result.score = node->beta;
         return result;
       }
       if (node->depth == 2 && sps >= node->beta + 5 * PAWN_VALUE) {
+        stats->margin_prunes++;
         result.type = MOVE_EVALUATED;
         result.score = node->beta;
         return result;
@@ -212,6 +272,7 @@ leafEvalResult evaluate_as_leaf(searchNode* node, searchType_t type) {
   if (type == SEARCH_SCOUT && node->depth <= FUT_DEPTH && node->depth > 0) {
     if (sps + fmarg[node->depth] < node->beta) {
       // treat this ply as a quiescence ply, look only at captures
+      stats->futility_prunes++;
       result.should_enter_quiescence = true;
       result.score = sps;
     }
@@ -219,46 +280,41 @@ leafEvalResult evaluate_as_leaf(searchNode* node, searchType_t type) {
   return result;
 }
 
-// Evaluate the move by performing a search.
-moveEvaluationResult evaluateMove(searchNode* node, move_t mv, move_t killer_a,
-                                  move_t killer_b, searchType_t type,
-                                  uint64_t* node_count_serial) {
+// Searches below the child of node that mv, which zapped victims, has just
+// made, and scores it.
+static void evaluate_made_move(searchNode* node, move_t mv, victims_t victims,
+                               move_t killer_a, move_t killer_b,
+                               searchType_t type,
+                               moveEvaluationResult* result) {
   int ext = 0;  // extensions
   bool blunder = false;  // shoot our own piece
-  moveEvaluationResult result;
-  result.next_node.subpv[0] = 0;
-  result.next_node.parent = node;
-
-  // Make the move, and get any victim pieces.
-  victims_t victims = make_move(&(node->position), &(result.next_node.position),
-                                mv);
 
   // Check whether this move changes the board state (moves that don't are
   // illegal).
   if (is_KO(victims)) {
-    result.type = MOVE_ILLEGAL;
-    return result;
+    result->type = MOVE_ILLEGAL;
+    return;
   }
 
   // Check whether the game is a game over position - either someone was shot or it's in our closing book.
-  if (is_end_game_position(&(result.next_node.position), node->pov, node->ply)) {
+  if (is_end_game_position(result->next_node.position, node->pov, node->ply)) {
     // Compute the end-game score.
-    result.type = MOVE_GAMEOVER;
-    result.score = get_end_game_score(&(result.next_node.position), node->pov, node->ply);
-    return result;
+    result->type = MOVE_GAMEOVER;
+    result->score = get_end_game_score(result->next_node.position, node->pov, node->ply);
+    return;
   }
 
   // Ignore noncapture moves when in quiescence.
   if (zero_victims(victims) && node->quiescence) {
-    result.type = MOVE_IGNORE;
-    return result;
+    result->type = MOVE_IGNORE;
+    return;
   }
 
   // Check whether the board state has been repeated, this results in a draw.
-  if (is_repeated(&(result.next_node.position), node->ply)) {
-    result.type = MOVE_GAMEOVER;
-    result.score = get_draw_score(&(result.next_node.position), node->ply);
-    return result;
+  if (is_repeated(&(result->next_node), node->ply)) {
+    result->type = MOVE_GAMEOVER;
+    result->score = get_draw_score(&(result->next_node), node->ply);
+    return;
   }
 
   // Check whether we blundered (caused only our own pieces to be zapped).
@@ -274,8 +330,8 @@ moveEvaluationResult evaluateMove(searchNode* node, move_t mv, move_t killer_a,
 
   // Do not consider moves that are blunders while in quiescence.
   if (node->quiescence && blunder) {
-    result.type = MOVE_IGNORE;
-    return result;
+    result->type = MOVE_IGNORE;
+    return;
   }
 
   // Extend the search-depth by 1 if we captured a piece, since that means the
@@ -299,7 +355,7 @@ moveEvaluationResult evaluateMove(searchNode* node, move_t mv, move_t killer_a,
     }
   }
 
-  result.type = MOVE_EVALUATED;
+  result->type = MOVE_EVALUATED;
   int search_depth = ext + node->depth - 1;
 
   // Check if we need to perform a reduced-depth search.
@@ -307,39 +363,63 @@ moveEvaluationResult evaluateMove(searchNode* node, move_t mv, move_t killer_a,
   // After a reduced-depth search, a full-depth search will be performed if the
   //  reduced-depth search did not trigger a cut-off.
   if (next_reduction > 0) {
+    searchStats* stats = &worker_context()->stats;
+    stats->lmr_reductions++;
     search_depth -= next_reduction;
-    int reduced_depth_score = -scout_search(&(result.next_node), search_depth,
-                                            node_count_serial);
+    int reduced_depth_score = -scout_search(&(result->next_node), search_depth);
     if (reduced_depth_score < node->beta) {
-      result.score = reduced_depth_score;
-      return result;
+      result->score = reduced_depth_score;
+      return;
     }
+    stats->lmr_researches++;
     search_depth += next_reduction;
   }
 
   // Check if we should abort due to time control.
   if (abortf) {
-    result.score = 0;
-    result.type = MOVE_IGNORE;
-    return result;
+    result->score = 0;
+    result->type = MOVE_IGNORE;
+    return;
   }
 
 
   if (type == SEARCH_SCOUT) {
-    result.score = -scout_search(&(result.next_node), search_depth,
-                                 node_count_serial);
+    result->score = -scout_search(&(result->next_node), search_depth);
   } else {
     if (node->legal_move_count == 0 || node->quiescence) {
-      result.score = -searchPV(&(result.next_node), search_depth, node_count_serial);
+      result->score = -searchPV(&(result->next_node), search_depth);
     } else {
-      result.score = -scout_search(&(result.next_node), search_depth,
-                                   node_count_serial);
-      if (result.score > node->alpha) {
-        result.score = -searchPV(&(result.next_node), node->depth + ext - 1, node_count_serial);
+      result->score = -scout_search(&(result->next_node), search_depth);
+      if (result->score > node->alpha) {
+        result->score = -searchPV(&(result->next_node), node->depth + ext - 1);
       }
     }
   }
+}
+
+// Evaluate the move by performing a search.  The move is made in p, which is
+// the position of node or, while brothers are searched in parallel, a copy of
+// it, and is taken back before returning.
+moveEvaluationResult evaluateMove(searchNode* node, position_t* p, move_t mv,
+                                  move_t killer_a, move_t killer_b,
+                                  searchType_t type) {
+  moveEvaluationResult result;
+  result.next_node.subpv[0] = 0;
+  result.next_node.parent = node;
+  result.next_node.position = p;
 
+  // Make the move, and get any victim pieces.
+  const undo_t* prev = node->parent != NULL ? &(node->undo) : NULL;
+  uint64_t start = profile_start();
+  victims_t victims = make_move_in_place(p, mv, prev, &(result.next_node.undo));
+  profile_stop(PROFILED_MAKE, start);
+  tt_prefetch(p->key);
+
+  evaluate_made_move(node, mv, victims, killer_a, killer_b, type, &result);
+
+  start = profile_start();
+  unmake_move(p, &(result.next_node.undo));
+  profile_stop(PROFILED_MAKE, start);
   return result;
 }
 
@@ -364,9 +444,14 @@ bool search_process_score(searchNode* node, move_t mv, int mv_index,
     node->best_move_index = mv_index;
     node->subpv[0] = mv;
 
-    // write best move into right position in PV buffer.
-    memcpy(node->subpv + 1, result->next_node.subpv,
-           sizeof(move_t) * (MAX_PLY_IN_SEARCH - 1));
+    // write best move into right position in PV buffer.  The PV ends at the
+    // first 0, so there is no need to copy the rest of the buffer.
+    for (int i = 0; i < MAX_PLY_IN_SEARCH - 2; i++) {
+      node->subpv[i + 1] = result->next_node.subpv[i];
+      if (result->next_node.subpv[i] == 0) {
+        break;
+      }
+    }
     node->subpv[MAX_PLY_IN_SEARCH - 1] = 0;
 
     if (type != SEARCH_SCOUT && result->score > node->alpha) {
@@ -374,6 +459,7 @@ bool search_process_score(searchNode* node, move_t mv, int mv_index,
     }
 
     if (result->score >= node->beta) {
+      move_t* killer = worker_context()->killer;
       if (mv != killer[KMT(node->ply, 0)] && ENABLE_TABLES) {
         killer[KMT(node->ply, 1)] = killer[KMT(node->ply, 0)];
         killer[KMT(node->ply, 0)] = mv;
@@ -384,51 +470,170 @@ bool search_process_score(searchNode* node, move_t mv, int mv_index,
   return false;
 }
 
-// Check if we should abort.
+// Check if we should abort.  Each worker counts its own tics, so that the
+// check costs no more than an increment of a counter in the worker's cache,
+// and only reads the clock once every ABORT_CHECK_PERIOD + 1 of them.
 bool should_abort_check() {
-  tics++;
-  if ((tics & ABORT_CHECK_PERIOD) == 0) {
-    if (milliseconds() >= timeout) {
-      abortf = true;
+  searchContext* context = worker_context();
+  if ((++context->tics & ABORT_CHECK_PERIOD) == 0) {
+    double d;
+    __atomic_load(&deadline, &d, __ATOMIC_RELAXED);
+    if (milliseconds() >= d) {
+      __atomic_store_n(&abortf, true, __ATOMIC_RELAXED);
       return true;
     }
   }
   return false;
 }
 
-// Obtain a sorted move list.
+// Staged move generation
 //
-// https://www.chessprogramming.org/Move_Ordering
-static int get_sortable_move_list(searchNode* node, sortable_move_t* move_list,
-                                  int hash_table_move) {
-  // number of moves in list
-  int num_of_moves = generate_all(&(node->position), move_list, false);
+// Most scout nodes cut off on the hash move or a killer, so those are tried
+// before any other move is generated.  The remaining moves are generated and
+// sorted only if none of them cuts off.  The order in which moves are searched
+// is the same as sorting the full list by sort key.
+//
+// https://www.chessprogramming.org/Move_Generation#Staged_Move_Generation
 
-  color_t fake_color_to_move = color_to_move_of(&(node->position));
+static const char* stage_names[NUM_MOVE_STAGES] = {
+  "hash move", "killers", "generated"
+};
 
-  move_t killer_a = killer[KMT(node->ply, 0)];
-  move_t killer_b = killer[KMT(node->ply, 1)];
+static void print_move_stage_stats(FILE* out, searchStats* stats) {
+  uint64_t nodes = stats->stage_nodes ? stats->stage_nodes : 1;
+  fprintf(out, "info string move stages: %" PRIu64 " nodes, %" PRIu64
+          " (%.1f%%) generated all moves\n", stats->stage_nodes,
+          stats->stage_generated, 100.0 * stats->stage_generated / nodes);
+  for (int i = 0; i < NUM_MOVE_STAGES; i++) {
+    fprintf(out, "info string   cutoffs on %-9s %" PRIu64 " (%.1f%% of nodes)\n",
+            stage_names[i], stats->stage_cutoffs[i],
+            100.0 * stats->stage_cutoffs[i] / nodes);
+  }
+}
+
+// Quiescence nodes only search moves that zap a piece, so their list is made
+// of those in full at once: generate_zaps finds them without making any move
+// and leaves out the losing ones.  The hash move goes first if it is there,
+// then the rest by static exchange.
+static void init_zap_list(searchNode* node, moveList* list,
+                          move_t hash_table_move) {
+  int exchange[MAX_NUM_MOVES];
+  uint64_t start = profile_start();
+  list->count = generate_zaps(node->position, list->moves, exchange);
+  profile_stop(PROFILED_GEN, start);
+  for (int i = 0; i < list->count; i++) {
+    set_sort_key(&list->moves[i], get_move(list->moves[i]) == hash_table_move ?
+                 SORT_MASK : (sort_key_t) exchange[i]);
+  }
+  sort_insertion(list->moves, list->count, 0);
+  list->num_special = 0;
+  list->complete = true;
+  searchStats* stats = &worker_context()->stats;
+  stats->zap_lists++;
+  stats->zaps += list->count;
+}
+
+// Starts the move list of node with the hash move and the killers that are
+// legal here, in that order.
+static void init_move_list(searchNode* node, moveList* list,
+                           move_t hash_table_move) {
+  list->count = 0;
+  list->complete = false;
+  list->hash_table_move = hash_table_move;
+  move_t* killer = worker_context()->killer;
+  list->killer_a = killer[KMT(node->ply, 0)];
+  list->killer_b = killer[KMT(node->ply, 1)];
+  if (node->quiescence) {
+    init_zap_list(node, list, hash_table_move);
+    return;
+  }
+
+  move_t special[3] = { list->hash_table_move, list->killer_a, list->killer_b };
+  for (int i = 0; i < 3; i++) {
+    move_t mv = special[i];
+    bool seen = (i > 0 && mv == special[0]) || (i > 1 && mv == special[1]);
+    if (!seen && is_generated_move(node->position, mv)) {
+      // These moves are searched first, so get their children's hash table
+      // sets on the way now.
+      tt_prefetch(zob_key_after_move(node->position, mv));
+      list->moves[list->count] = mv;
+      set_sort_key(&list->moves[list->count], SORT_MASK - i);
+      list->count++;
+    }
+  }
+  list->num_special = list->count;
+}
+
+// Appends every move of node that init_move_list did not put in the list,
+// sorted by best_move_history.
+static void complete_move_list(searchNode* node, moveList* list) {
+  sortable_move_t all[MAX_NUM_MOVES];
+  uint64_t start = profile_start();
+  int num_of_moves = generate_all(node->position, all, false);
+  profile_stop(PROFILED_GEN, start);
+  color_t fake_color_to_move = color_to_move_of(node->position);
+  int first = list->count;
+  searchContext* context = worker_context();
 
-  // sort special moves to the front
   for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    move_t mv = get_move(move_list[mv_index]);
-    if (mv == hash_table_move) {
-      set_sort_key(&move_list[mv_index], SORT_MASK);
-    } else if (mv == killer_a) {
-      set_sort_key(&move_list[mv_index], SORT_MASK - 1);
-    } else if (mv == killer_b) {
-      set_sort_key(&move_list[mv_index], SORT_MASK - 2);
-    } else {
-      ptype_t  pce = ptype_mv_of(mv);
-      rot_t    ro  = rot_of(mv);   // rotation
-      square_t fs  = from_square(mv);
-      int      ot  = ORI_MASK & (ori_of(node->position.board[fs]) + ro);
-      square_t ts  = to_square(mv);
-      set_sort_key(&move_list[mv_index],
-                   best_move_history[BMH(fake_color_to_move, pce, ts, ot)]);
+    move_t mv = get_move(all[mv_index]);
+    bool special = false;
+    for (int i = 0; i < list->num_special; i++) {
+      special |= (mv == get_move(list->moves[i]));
+    }
+    if (special) {
+      continue;
     }
+    tbassert(mv != list->hash_table_move && mv != list->killer_a &&
+             mv != list->killer_b, "is_generated_move rejected a legal move\n");
+
+    ptype_t  pce = ptype_mv_of(mv);
+    rot_t    ro  = rot_of(mv);   // rotation
+    square_t fs  = from_square(mv);
+    int      ot  = ORI_MASK & (ori_of(node->position->board[fs]) + ro);
+    square_t ts  = to_square(mv);
+    sortable_move_t smv = all[mv_index];
+    set_sort_key(&smv,
+                 context->best_move_history[BMH(fake_color_to_move, pce, ts, ot)]);
+    list->moves[list->count++] = smv;
   }
-  return num_of_moves;
+
+  tbassert(list->count == num_of_moves,
+           "special moves not generated: %d != %d\n", list->count, num_of_moves);
+
+  sort_insertion(list->moves + first, list->count - first, 0);
+  list->complete = true;
+  context->stats.stage_generated++;
 }
 
+// Returns whether node has a move with index mv_index, generating the rest of
+// the moves once the hash move and killers are used up.
+static bool has_move(searchNode* node, moveList* list, int mv_index) {
+  if (mv_index >= list->count && !list->complete) {
+    complete_move_list(node, list);
+  }
+  return mv_index < list->count;
+}
 
+// Counts the node in the stage statistics.  best_move_index is only valid if
+// cutoff is true.
+static void count_move_stage(moveList* list, int moves_tried, bool cutoff,
+                             int best_move_index) {
+  if (moves_tried == 0) {
+    return;
+  }
+  searchStats* stats = &worker_context()->stats;
+  stats->stage_nodes++;
+  if (cutoff) {
+    stats->cutoff_index[best_move_index < CUTOFF_BUCKETS ?
+                        best_move_index : CUTOFF_BUCKETS - 1]++;
+    if (best_move_index >= list->num_special) {
+      stats->stage_cutoffs[MOVE_STAGE_GENERATED]++;
+    } else if (list->hash_table_move != 0 &&
+               get_move(list->moves[best_move_index]) == list->hash_table_move) {
+      stats->stage_cutoffs[MOVE_STAGE_HASH]++;
+    } else {
+      stats->stage_cutoffs[MOVE_STAGE_KILLERS]++;
+    }
+  }
+}
@@ -8,22 +8,170 @@
 // FORMAT: killer[ply][id]
 #define __KMT_dim__ [MAX_PLY_IN_SEARCH*4]  // NOLINT(whitespace/braces)
 #define KMT(ply, id) (4 * ply + id)
-static move_t killer __KMT_dim__;  // up to 4 killers
 
 // Best move history table and lookup function
 //
 // https://www.chessprogramming.org/History_Heuristic
 //
 // FORMAT: best_move_history[color_t][piece_t][square_t][orientation]
-#define __BMH_dim__ [2*6*ARR_SIZE*NUM_ORI]  // NOLINT(whitespace/braces)
+#define BMH_SIZE (2*6*ARR_SIZE*NUM_ORI)
+#define __BMH_dim__ [BMH_SIZE]  // NOLINT(whitespace/braces)
 #define BMH(color, piece, square, ori)                             \
     (color * 6 * ARR_SIZE * NUM_ORI + piece * ARR_SIZE * NUM_ORI + \
      square * NUM_ORI + ori)
 
-static int best_move_history __BMH_dim__;
+// Stages of move generation, in the order they are searched
+typedef enum {
+  MOVE_STAGE_HASH,
+  MOVE_STAGE_KILLERS,
+  MOVE_STAGE_GENERATED,
+  NUM_MOVE_STAGES
+} moveStage_t;
+
+// What the profile option times, see profile_start
+typedef enum {
+  PROFILED_EVAL,
+  PROFILED_GEN,
+  PROFILED_MAKE,
+  NUM_PROFILED
+} profiled_t;
+
+// Cutoffs are counted by the index of the move that caused them, with the
+// last bucket taking all the later ones.
+#define CUTOFF_BUCKETS 8
+
+// Counters behind the stats command.  They hold nothing but uint64_t, so that
+// those of all workers can be added up as arrays (see sum_search_stats).
+typedef struct searchStats {
+  uint64_t nodes;               // moves made
+  uint64_t qnodes;              // moves made at quiescence nodes
+  uint64_t stage_nodes;         // nodes that searched at least one move
+  uint64_t stage_cutoffs[NUM_MOVE_STAGES];
+  uint64_t stage_generated;     // nodes that had to generate all moves
+  uint64_t cutoff_index[CUTOFF_BUCKETS];
+  uint64_t tt_probes;
+  uint64_t tt_hits;             // probes that found the position
+  uint64_t tt_cutoffs;          // hits that ended the search of the node
+  uint64_t tt_stores;
+  uint64_t tt_collisions;       // stores that evicted another position
+  uint64_t margin_prunes;       // nodes cut off by the null move margin
+  uint64_t futility_prunes;     // nodes limited to captures by futility
+  uint64_t lmr_reductions;
+  uint64_t lmr_researches;      // reduced moves searched again in full
+  uint64_t zap_lists;           // quiescence nodes that generated their zaps
+  uint64_t zaps;                // zaps in those lists
+  uint64_t cycles[NUM_PROFILED];
+} searchStats;
+
+// Everything that a worker writes at every node, so that workers neither race
+// on the tables nor share cache lines.  Killers stay with their worker.  The
+// histories are merged at the start of every iteration (see
+// merge_best_move_history).
+typedef struct searchContext {
+  move_t      killer __KMT_dim__;  // up to 4 killers
+  int         best_move_history __BMH_dim__;
+  uint32_t    tics;                // nodes since init_tics, to time the search
+  searchStats stats;
+} __attribute__((aligned(64))) searchContext;
+
+static searchContext* contexts = NULL;  // one per worker
+static int num_contexts = 0;
+
+// Gives each of n workers a context, keeping the current ones if there are
+// already n.
+static void init_search_contexts(int n) {
+  if (n == num_contexts) {
+    return;
+  }
+  free(contexts);
+  if (posix_memalign((void**) &contexts, __alignof__(searchContext),
+                     sizeof(searchContext) * n) != 0) {
+    fprintf(stderr, "Out of memory for the search contexts\n");
+    exit(1);
+  }
+  memset(contexts, 0, sizeof(searchContext) * n);
+  num_contexts = n;
+}
+
+// Returns the context of the worker running the caller.  Worker numbers are
+// below the number of workers, except perhaps for threads that were not
+// started by the runtime, which share the first context.
+static inline searchContext* worker_context() {
+  int w = __cilkrts_get_worker_number();
+  return &contexts[(w >= 0 && w < num_contexts) ? w : 0];
+}
+
+// Returns the nodes searched by all workers since the stats were reset.
+static uint64_t context_nodes() {
+  uint64_t nodes = 0;
+  for (int w = 0; w < num_contexts; w++) {
+    nodes += contexts[w].stats.nodes;
+  }
+  return nodes;
+}
+
+// Returns the nodes searched since the stats were reset by the search of the
+// caller.  A serial search runs on a single worker, while the others may be
+// running searches of their own (see analyze), so it only counts its own.
+static uint64_t search_nodes() {
+  return THREADS == 1 ? worker_context()->stats.nodes : context_nodes();
+}
+
+// Adds up the counters of all workers into total.
+static void sum_search_stats(searchStats* total) {
+  memset(total, 0, sizeof(*total));
+  uint64_t* sum = (uint64_t*) total;
+  for (int w = 0; w < num_contexts; w++) {
+    uint64_t* counter = (uint64_t*) &contexts[w].stats;
+    for (size_t i = 0; i < sizeof(searchStats) / sizeof(uint64_t); i++) {
+      sum[i] += counter[i];
+    }
+  }
+}
+
+// With the profile option on, the cycles from profile_start to profile_stop
+// are added to what of the worker.  Reading the cycle counter around every
+// call costs about as much as a small call, so it is off by default.
+static inline uint64_t profile_start() {
+  return PROFILE ? read_cycle_counter() : 0;
+}
+
+static inline void profile_stop(profiled_t what, uint64_t start) {
+  if (PROFILE) {
+    worker_context()->stats.cycles[what] += read_cycle_counter() - start;
+  }
+}
 
 void init_best_move_history() {
-  memset(best_move_history, 0, sizeof(best_move_history));
+  for (int w = 0; w < num_contexts; w++) {
+    memset(contexts[w].best_move_history, 0,
+           sizeof(contexts[w].best_move_history));
+  }
+}
+
+void init_killers() {
+  for (int w = 0; w < num_contexts; w++) {
+    memset(contexts[w].killer, 0, sizeof(contexts[w].killer));
+  }
+}
+
+// Replaces the history of every worker with the average of all of them.
+// Must not be called while workers are searching.  Serial searches, of which
+// analyze runs several at once, have nothing to merge.
+static void merge_best_move_history() {
+  if (THREADS == 1 || num_contexts == 1) {
+    return;
+  }
+  for (int i = 0; i < BMH_SIZE; i++) {
+    int64_t sum = 0;
+    for (int w = 0; w < num_contexts; w++) {
+      sum += contexts[w].best_move_history[i];
+    }
+    int s = sum / num_contexts;
+    for (int w = 0; w < num_contexts; w++) {
+      contexts[w].best_move_history[i] = s;
+    }
+  }
 }
 
 static void update_best_move_history(position_t* p, int index_of_best,
@@ -31,6 +179,7 @@ static void update_best_move_history(position_t* p, int index_of_best,
   tbassert(ENABLE_TABLES, "Tables weren't enabled.\n");
 
   int color_to_move = color_to_move_of(p);
+  int* best_move_history = worker_context()->best_move_history;
 
   for (int i = 0; i < count; i++) {
     move_t   mv  = get_move(lst[i]);
@@ -54,26 +203,34 @@ static void update_best_move_history(position_t* p, int index_of_best,
 }
 
 static void update_transposition_table(searchNode* node) {
+  int bound;
+  move_t move = node->subpv[0];
   if (node->type == SEARCH_SCOUT) {
     if (node->best_score < node->beta) {
-      tt_hashtable_put(node->position.key, node->depth,
-                       tt_adjust_score_for_hashtable(node->best_score, node->ply),
-                       UPPER, 0);
+      bound = UPPER;
+      move = 0;
     } else {
-      tt_hashtable_put(node->position.key, node->depth,
-                       tt_adjust_score_for_hashtable(node->best_score, node->ply),
-                       LOWER, node->subpv[0]);
+      bound = LOWER;
     }
   } else if (node->type == SEARCH_PV) {
     if (node->best_score <= node->orig_alpha) {
-      tt_hashtable_put(node->position.key, node->depth,
-                       tt_adjust_score_for_hashtable(node->best_score, node->ply), UPPER, 0);
+      bound = UPPER;
+      move = 0;
     } else if (node->best_score >= node->beta) {
-      tt_hashtable_put(node->position.key, node->depth,
-                       tt_adjust_score_for_hashtable(node->best_score, node->ply), LOWER, node->subpv[0]);
+      bound = LOWER;
     } else {
-      tt_hashtable_put(node->position.key, node->depth,
-                       tt_adjust_score_for_hashtable(node->best_score, node->ply), EXACT, node->subpv[0]);
+      bound = EXACT;
     }
+  } else {
+    return;
   }
+
+  int sym;
+  uint64_t key = tt_key_of(node->position, &sym);
+  searchStats* stats = &worker_context()->stats;
+  stats->tt_stores++;
+  stats->tt_collisions +=
+      tt_hashtable_put(key, node->depth,
+                       tt_adjust_score_for_hashtable(node->best_score, node->ply),
+                       bound, sym_move(sym, move));
 }
@@ -41,15 +41,66 @@ static void initialize_scout_node(searchNode* node, int depth) {
   node->ply = node->parent->ply + 1;
   node->subpv[0] = 0;
   node->legal_move_count = 0;
-  node->fake_color_to_move = color_to_move_of(&(node->position));
+  node->fake_color_to_move = color_to_move_of(node->position);
   // point of view = 1 for white, -1 for black
   node->pov = 1 - node->fake_color_to_move * 2;
   node->best_move_index = 0;  // index of best move found
   node->abort = false;
 }
 
-static score_t scout_search(searchNode* node, int depth,
-                            uint64_t* node_count_serial) {
+// Searches the next unclaimed move of list below node, making it in p (see
+// evaluateMove).  Returns true if it produced a cutoff, which is also recorded
+// in node->abort so that the brothers still being searched, and everything
+// below them, stop early.
+//
+// Several moves of one node may be searched at once, so node is only
+// updated while holding node_mutex.
+static bool scout_search_move(searchNode* node, position_t* p, moveList* list,
+                              int* number_of_moves_evaluated,
+                              simple_mutex_t* node_mutex) {
+  // Get the next move from the move list.
+  int local_index = __sync_fetch_and_add(number_of_moves_evaluated, 1);
+  move_t mv = get_move(list->moves[local_index]);
+
+  if (TRACE_MOVES) {
+    print_move_info(mv, node->ply);
+  }
+
+  // increase node count
+  searchStats* stats = &worker_context()->stats;
+  stats->nodes++;
+  stats->qnodes += node->quiescence;
+
+  moveEvaluationResult result = evaluateMove(node, p, mv, list->killer_a,
+                                             list->killer_b, SEARCH_SCOUT);
+
+  if (result.type == MOVE_ILLEGAL || result.type == MOVE_IGNORE
+      || abortf || parallel_parent_aborted(node)
+      || parallel_node_aborted(node)) {
+    return false;
+  }
+
+  simple_acquire(node_mutex);
+
+  // A legal move is a move that's not KO, but when we are in quiescence
+  // we only want to count moves that has a capture.
+  if (result.type == MOVE_EVALUATED) {
+    node->legal_move_count++;
+  }
+
+  // process the score. Note that this mutates fields in node.
+  bool cutoff = !node->abort &&
+      search_process_score(node, mv, local_index, &result, SEARCH_SCOUT);
+
+  if (cutoff) {
+    node->abort = true;
+  }
+
+  simple_release(node_mutex);
+  return cutoff;
+}
+
+static score_t scout_search(searchNode* node, int depth) {
   // Initialize the search node.
   initialize_scout_node(node, depth);
 
@@ -72,16 +123,10 @@ static score_t scout_search(searchNode* node, int depth,
   node->best_score = pre_evaluation_result.score;
   node->quiescence = pre_evaluation_result.should_enter_quiescence;
 
-  // Grab the killer-moves for later use.
-  move_t killer_a = killer[KMT(node->ply, 0)];
-  move_t killer_b = killer[KMT(node->ply, 1)];
-
-  // Store the sorted move list on the stack.
-  //   MAX_NUM_MOVES is all that we need.
-  sortable_move_t move_list[MAX_NUM_MOVES];
-
-  // Obtain the sorted move list.
-  int num_of_moves = get_sortable_move_list(node, move_list, hash_table_move);
+  // Store the move list on the stack.  It starts with the hash move and the
+  //   killers; the other moves are only generated if those don't cut off.
+  moveList list;
+  init_move_list(node, &list, hash_table_move);
 
   int number_of_moves_evaluated = 0;
 
@@ -90,61 +135,53 @@ static score_t scout_search(searchNode* node, int depth,
   simple_mutex_t node_mutex;
   init_simple_mutex(&node_mutex);
 
-  // Sort the move list.
-  sort_insertion(move_list, num_of_moves, number_of_moves_evaluated);
-
-  for (int mv_index = 0; mv_index < num_of_moves; mv_index++) {
-    // Get the next move from the move list.
-    int local_index = number_of_moves_evaluated++;
-    move_t mv = get_move(move_list[local_index]);
-
-    if (TRACE_MOVES) {
-      print_move_info(mv, node->ply);
-    }
-
-    // increase node count
-    __sync_fetch_and_add(node_count_serial, 1);
-
-    moveEvaluationResult result = evaluateMove(node, mv, killer_a, killer_b,
-                                               SEARCH_SCOUT,
-                                               node_count_serial);
-
-    if (result.type == MOVE_ILLEGAL || result.type == MOVE_IGNORE
-        || abortf || parallel_parent_aborted(node)) {
-      continue;
-    }
-
-    // A legal move is a move that's not KO, but when we are in quiescence
-    // we only want to count moves that has a capture.
-    if (result.type == MOVE_EVALUATED) {
-      node->legal_move_count++;
+  // Young Brothers Wait: the eldest brother is searched by itself, since it
+  // is the move most likely to cut off.  Only once it has been searched
+  // without a cutoff are its younger brothers searched in parallel.
+  //
+  // https://www.chessprogramming.org/Young_Brothers_Wait_Concept
+  bool parallel = THREADS > 1 && !node->quiescence &&
+                  node->depth >= PARALLEL_DEPTH;
+  bool cutoff = false;
+  int mv_index = 0;
+
+  while (has_move(node, &list, mv_index)) {
+    mv_index++;
+    cutoff = scout_search_move(node, node->position, &list,
+                               &number_of_moves_evaluated, &node_mutex);
+    if (cutoff || (parallel && node->legal_move_count > 0)) {
+      break;
     }
+  }
 
-    // process the score. Note that this mutates fields in node.
-    bool cutoff = search_process_score(node, mv, local_index, &result, SEARCH_SCOUT);
-
-    if (cutoff) {
-      node->abort = true;
-      break;
+  if (parallel && !cutoff && has_move(node, &list, mv_index)) {
+    cilk_for (int i = mv_index; i < list.count; i++) {
+      if (!node->abort && !abortf && !parallel_parent_aborted(node)) {
+        // Brothers searched at the same time each need their own position.
+        position_t p = *(node->position);
+        scout_search_move(node, &p, &list, &number_of_moves_evaluated,
+                          &node_mutex);
+      }
     }
   }
 
+  count_move_stage(&list, number_of_moves_evaluated, node->abort,
+                   node->best_move_index);
+
   if (parallel_parent_aborted(node)) {
     return 0;
   }
 
   if (node->quiescence == false) {
-    update_best_move_history(&(node->position), node->best_move_index,
-                             move_list, number_of_moves_evaluated);
+    update_best_move_history(node->position, node->best_move_index,
+                             list.moves, number_of_moves_evaluated);
   }
 
   tbassert(abs(node->best_score) != -INF, "best_score = %d\n",
            node->best_score);
 
-  // Reads node->position.key, node->depth, node->best_score, and node->ply
+  // Reads node->position->key, node->depth, node->best_score, and node->ply
   update_transposition_table(node);
 
   return node->best_score;
 }
-
-
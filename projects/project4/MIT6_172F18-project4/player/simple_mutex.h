@@ -1,25 +1,152 @@
 // Copyright (c) 2015 MIT License by 6.172 Staff
 
-// A simple implementation of a spin lock using compare and swap.
+// A simple lock for the short critical sections of the search.
+//
+// The lock is tried with compare and swap.  If it is taken, the waiter spins
+// on plain reads, test and test-and-set, so that it does not keep stealing the
+// cache line from the holder, and pauses for exponentially longer between
+// tries.  Once SIMPLE_MUTEX_SPINS pauses have passed, it stops burning its
+// core and sleeps on a futex until the holder wakes it.
+//
+// The state of the lock is 0 when free, 1 when held, and 2 when held with
+// possible sleepers, as in Drepper's "Futexes Are Tricky".
 #ifndef SIMPLE_MUTEX_H
 #define SIMPLE_MUTEX_H
 
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !MACPORT
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+#include "./tbassert.h"
+#include "./util.h"
+
+// Pauses spent spinning before going to sleep, and the longest single backoff
+#define SIMPLE_MUTEX_SPINS 4096
+#define SIMPLE_MUTEX_MAX_BACKOFF 256
 
 typedef int simple_mutex_t;
 
+// Lock counters of one thread.  Each thread writes only its own, so counting
+// costs no more than an increment.
+typedef struct simple_mutex_stats {
+  uint64_t acquisitions;
+  uint64_t contended;          // acquisitions that found the lock held
+  uint64_t sleeps;             // futex waits
+  uint64_t contention_cycles;  // cycles spent waiting in contended ones
+} __attribute__((aligned(64))) simple_mutex_stats_t;
+
+// Threads get a slot the first time they take a lock, and keep it.  Slots are
+// never freed, since Cilk workers come and go with init_search_threads, so
+// threads past the last slot share it.
+#define SIMPLE_MUTEX_SLOTS 1024
+static simple_mutex_stats_t simple_mutex_slots[SIMPLE_MUTEX_SLOTS];
+static int simple_mutex_num_slots = 0;
+static __thread simple_mutex_stats_t* simple_mutex_my_stats = NULL;
+
+static inline simple_mutex_stats_t* simple_mutex_stats() {
+  if (simple_mutex_my_stats == NULL) {
+    int slot = __sync_fetch_and_add(&simple_mutex_num_slots, 1);
+    if (slot >= SIMPLE_MUTEX_SLOTS) {
+      slot = SIMPLE_MUTEX_SLOTS - 1;
+    }
+    simple_mutex_my_stats = &simple_mutex_slots[slot];
+  }
+  return simple_mutex_my_stats;
+}
+
+static inline void simple_mutex_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Sleeps while *mutex is value.
+static inline void simple_mutex_wait(simple_mutex_t* mutex, int value) {
+#if MACPORT
+  if (*(volatile simple_mutex_t*) mutex == value) {
+    sched_yield();
+  }
+#else
+  syscall(SYS_futex, mutex, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#endif
+}
+
+// Wakes up one thread sleeping on mutex.
+static inline void simple_mutex_wake(simple_mutex_t* mutex) {
+#if !MACPORT
+  syscall(SYS_futex, mutex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
 void init_simple_mutex(simple_mutex_t* mutex) {
   *mutex = 0;
 }
 
 void simple_acquire(simple_mutex_t* mutex) {
-  while (!__sync_bool_compare_and_swap(mutex, 0, 1)) {
-    continue;  // Did not acquire lock yet.
+  simple_mutex_stats_t* stats = simple_mutex_stats();
+  stats->acquisitions++;
+  if (__sync_bool_compare_and_swap(mutex, 0, 1)) {
+    return;
+  }
+
+  stats->contended++;
+  uint64_t start = read_cycle_counter();
+
+  int backoff = 1;
+  for (int spins = 0; spins < SIMPLE_MUTEX_SPINS; spins += backoff) {
+    if (*(volatile simple_mutex_t*) mutex == 0 &&
+        __sync_bool_compare_and_swap(mutex, 0, 1)) {
+      stats->contention_cycles += read_cycle_counter() - start;
+      return;
+    }
+    for (int i = 0; i < backoff; i++) {
+      simple_mutex_pause();
+    }
+    if (backoff < SIMPLE_MUTEX_MAX_BACKOFF) {
+      backoff *= 2;
+    }
+  }
+
+  // Announce a sleeper, so that the release wakes us up.
+  while (__sync_lock_test_and_set(mutex, 2) != 0) {
+    stats->sleeps++;
+    simple_mutex_wait(mutex, 2);
   }
+  stats->contention_cycles += read_cycle_counter() - start;
 }
 
 void simple_release(simple_mutex_t* mutex) {
-  if (!__sync_bool_compare_and_swap(mutex, 1, 0)) {
-    printf("ERROR!\n");
+  int state = __sync_fetch_and_sub(mutex, 1);
+  tbassert(state != 0, "released a mutex that was not held\n");
+  if (state != 1) {
+    // There may be sleepers.
+    __sync_lock_release(mutex);
+    simple_mutex_wake(mutex);
+  }
+}
+
+// Zeroes the counters of all threads.  Must not be called while a search is
+// running.
+void simple_mutex_reset_stats() {
+  memset(simple_mutex_slots, 0, sizeof(simple_mutex_slots));
+}
+
+// Adds up the counters of all threads into total.
+void simple_mutex_get_stats(simple_mutex_stats_t* total) {
+  memset(total, 0, sizeof(*total));
+  int num_slots = simple_mutex_num_slots < SIMPLE_MUTEX_SLOTS ?
+                  simple_mutex_num_slots : SIMPLE_MUTEX_SLOTS;
+  for (int i = 0; i < num_slots; i++) {
+    total->acquisitions += simple_mutex_slots[i].acquisitions;
+    total->contended += simple_mutex_slots[i].contended;
+    total->sleeps += simple_mutex_slots[i].sleeps;
+    total->contention_cycles += simple_mutex_slots[i].contention_cycles;
   }
 }
 
@@ -0,0 +1,629 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Endgame tablebases
+//
+// https://www.chessprogramming.org/Endgame_Tablebases
+// https://www.chessprogramming.org/Retrograde_Analysis
+
+#include "./tablebase.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cilk/cilk.h>
+
+#include "./search.h"
+#include "./tbassert.h"
+#include "./util.h"
+
+// One byte per position, from the point of view of the side to move:
+//   0          neither side can force a win
+//   1 .. 127   wins, zapping the enemy King that many plies from now
+//   129 .. 255 loses, its King is zapped (value - 128) plies from now
+//   128        not a position, two pieces share a square
+// Wins and losses that take longer than TB_MAX_DIST plies are stored as
+// draws.
+typedef uint8_t tbValue_t;
+#define TB_DRAW 0
+#define TB_INVALID 128
+#define TB_MAX_DIST 127
+#define TB_WIN(d) ((tbValue_t) (d))
+#define TB_LOSS(d) ((tbValue_t) (128 + (d)))
+
+// The rules do not tell the colors apart, so a position with Black to move
+// has the value of its color-swapped image (SYM_COLOR), which has White to
+// move.  The tables only hold positions with White to move, indexed by one
+// byte per piece: the White King, the Black King, the White Pawns, then the
+// Black Pawns.  The byte is the bitboard index of the square times NUM_ORI
+// plus the orientation.  Pawns of one color are listed in increasing order,
+// so that every position has exactly one index.
+#define TB_CODE_BITS 8
+#define TB_CODE_MASK 0xff
+
+// The tables with the same number of Pawns make up a group, one table per
+// number of Black Pawns, in increasing order.  The color swap moves positions
+// between the tables of a group, so a group is generated as a whole, and its
+// positions are indexed by the table followed by the index in the table.
+
+// header of a file written by tb_generate; the groups follow in order
+#define TB_FILE_MAGIC "LSCHSTB"
+#define TB_FILE_VERSION 2
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t max_pawns;
+} tbFileHeader_t;
+
+// The pieces of a position in index order
+#define TB_MAX_PIECES (2 + TB_MAX_PAWNS)
+typedef struct {
+  int      num_pieces;
+  color_t  stm;  // side to move
+  square_t sq[TB_MAX_PIECES];
+  piece_t  piece[TB_MAX_PIECES];
+} tbPieces_t;
+
+// The state of the generator for one group
+typedef struct {
+  int        num_pawns;
+  uint64_t   size;
+  tbValue_t* value;
+  uint8_t*   count;      // moves to positions of this group not yet won
+  uint8_t*   conv_win;   // shortest win by a move that zaps, 0 if none
+  uint8_t*   conv_loss;  // longest loss by a move that zaps, | TB_CONV_DRAW
+} tbGen_t;               // if one of those moves draws
+
+#define TB_CONV_DRAW 0x80
+
+// loaded groups, see tb_load
+static const tbValue_t* tb_values[TB_MAX_PAWNS + 1];
+static int tb_max_pawns = -1;  // largest number of Pawns covered, -1 if none
+static void* tb_mapping;
+static size_t tb_mapping_bytes;
+
+// Previous position of every position the generator sets up.  make_move looks
+// at it for the Ko rule, and it matches nothing.
+static position_t tb_history;
+
+static uint64_t table_size(int num_pawns) {
+  return 1ULL << (TB_CODE_BITS * (2 + num_pawns));
+}
+
+static uint64_t group_size(int num_pawns) {
+  return (num_pawns + 1) * table_size(num_pawns);
+}
+
+static int code_of(square_t sq, piece_t x) {
+  return (BOARD_WIDTH * fil_of(sq) + rnk_of(sq)) * NUM_ORI + ori_of(x);
+}
+
+// ----------------------------------------------------------------------------
+// Indexing
+// ----------------------------------------------------------------------------
+
+// The index of p in its group, that of its color-swapped image if Black is
+// to move: the side to move takes the place of White.
+static uint64_t index_of_position(position_t* p) {
+  color_t order[2] = { color_to_move_of(p), opp_color(color_to_move_of(p)) };
+  uint64_t idx = 0;
+  for (int i = 0; i < 2; i++) {
+    square_t sq = p->kloc[order[i]];
+    idx = (idx << TB_CODE_BITS) | code_of(sq, p->board[sq]);
+  }
+  int pawns[2];
+  for (int i = 0; i < 2; i++) {
+    bitboard_t b = p->bb_pieces[order[i]][PAWN - PAWN];
+    pawns[i] = __builtin_popcountll(b);
+    for (; b; b &= b - 1) {
+      square_t sq = square_of_bb_index(__builtin_ctzll(b));
+      idx = (idx << TB_CODE_BITS) | code_of(sq, p->board[sq]);
+    }
+  }
+  return pawns[1] * table_size(pawns[0] + pawns[1]) + idx;
+}
+
+// Decodes idx of the group with num_pawns Pawns into a position with White
+// to move.  Returns false if idx is not the index of a position.
+static bool pieces_of_index(int num_pawns, uint64_t idx, tbPieces_t* pc) {
+  int black_pawns = idx / table_size(num_pawns);
+  int white_pawns = num_pawns - black_pawns;
+  pc->num_pieces = 2 + num_pawns;
+  for (int i = pc->num_pieces - 1; i >= 0; i--) {
+    int code = idx & TB_CODE_MASK;
+    idx >>= TB_CODE_BITS;
+
+    piece_t x = 0;
+    set_ptype(&x, i < 2 ? KING : PAWN);
+    set_color(&x, (i == 1 || i >= 2 + white_pawns) ? BLACK : WHITE);
+    set_ori(&x, code % NUM_ORI);
+    pc->piece[i] = x;
+    pc->sq[i] = square_of_bb_index(code / NUM_ORI);
+  }
+  pc->stm = WHITE;
+
+  for (int i = 0; i < pc->num_pieces; i++) {
+    for (int j = i + 1; j < pc->num_pieces; j++) {
+      if (pc->sq[i] == pc->sq[j]) {
+        return false;
+      }
+    }
+  }
+  // Pawns of one color in increasing order.  The Pawns start at index 2;
+  // bounding the loop by TB_MAX_PIECES as well shows that it stays within
+  // the arrays, and drops it when there is room for a single Pawn.
+  for (int i = 3; i < pc->num_pieces && i < TB_MAX_PIECES; i++) {
+    if (color_of(pc->piece[i - 1]) == color_of(pc->piece[i]) &&
+        pc->sq[i - 1] > pc->sq[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Restores the index order of the Pawns after some of them moved.
+static void sort_pawns(tbPieces_t* pc) {
+  for (int i = 3; i < pc->num_pieces && i < TB_MAX_PIECES; i++) {
+    for (int j = i; j > 2; j--) {
+      int a = color_of(pc->piece[j - 1]) * BB_SIZE +
+              code_of(pc->sq[j - 1], pc->piece[j - 1]) / NUM_ORI;
+      int b = color_of(pc->piece[j]) * BB_SIZE +
+              code_of(pc->sq[j], pc->piece[j]) / NUM_ORI;
+      if (a < b) {
+        break;
+      }
+      square_t sq = pc->sq[j];
+      piece_t x = pc->piece[j];
+      pc->sq[j] = pc->sq[j - 1];
+      pc->piece[j] = pc->piece[j - 1];
+      pc->sq[j - 1] = sq;
+      pc->piece[j - 1] = x;
+    }
+  }
+}
+
+static void position_of_pieces(tbPieces_t* pc, position_t* p) {
+  for (int i = 0; i < ARR_SIZE; i++) {
+    p->board[i] = 0;
+    set_ptype(&p->board[i], INVALID);
+  }
+  for (fil_t f = 0; f < BOARD_WIDTH; f++) {
+    for (rnk_t r = 0; r < BOARD_WIDTH; r++) {
+      p->board[square_of(f, r)] = 0;
+    }
+  }
+  for (int i = 0; i < pc->num_pieces; i++) {
+    p->board[pc->sq[i]] = pc->piece[i];
+  }
+  p->kloc[WHITE] = pc->sq[0];
+  p->kloc[BLACK] = pc->sq[1];
+  p->ply = pc->stm;
+  p->history = &tb_history;
+  p->last_move = 0;
+  p->victims.zapped_count = 0;
+  p->victims.zapped = 0;
+  init_bitboards(p);
+  init_laser_paths(p);
+  p->key = compute_zob_key(p);
+}
+
+// ----------------------------------------------------------------------------
+// Probing
+// ----------------------------------------------------------------------------
+
+static bool decode_value(tbValue_t v, int* result, int* distance) {
+  if (v == TB_INVALID) {
+    return false;
+  }
+  if (v == TB_DRAW) {
+    *result = 0;
+    *distance = 0;
+  } else if (v < TB_INVALID) {
+    *result = 1;
+    *distance = v;
+  } else {
+    *result = -1;
+    *distance = v - TB_INVALID;
+  }
+  return true;
+}
+
+bool tb_probe(position_t* p, int* result, int* distance) {
+  if (tb_max_pawns < 0) {
+    return false;
+  }
+  int num_pawns = __builtin_popcountll(p->bb_pieces[WHITE][PAWN - PAWN]) +
+                  __builtin_popcountll(p->bb_pieces[BLACK][PAWN - PAWN]);
+  if (num_pawns > tb_max_pawns) {
+    return false;
+  }
+  tbValue_t v = tb_values[num_pawns][index_of_position(p)];
+  return decode_value(v, result, distance);
+}
+
+static void tb_unload() {
+  if (tb_mapping != NULL) {
+    munmap(tb_mapping, tb_mapping_bytes);
+    tb_mapping = NULL;
+  }
+  memset(tb_values, 0, sizeof(tb_values));
+  tb_max_pawns = -1;
+}
+
+// Points tb_values at the groups stored after the header in mem.
+static void attach_tables(const char* mem, int max_pawns) {
+  const tbValue_t* group = (const tbValue_t*) (mem + sizeof(tbFileHeader_t));
+  for (int n = 0; n <= max_pawns; n++) {
+    tb_values[n] = group;
+    group += group_size(n);
+  }
+  tb_max_pawns = max_pawns;
+}
+
+static size_t file_size(int max_pawns) {
+  size_t bytes = sizeof(tbFileHeader_t);
+  for (int n = 0; n <= max_pawns; n++) {
+    bytes += group_size(n);
+  }
+  return bytes;
+}
+
+bool tb_load(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  tbFileHeader_t header;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, TB_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s: not a tablebase file\n", filename);
+    close(fd);
+    return false;
+  }
+  if (header.version != TB_FILE_VERSION || header.max_pawns > TB_MAX_PAWNS ||
+      (size_t) st.st_size != file_size(header.max_pawns)) {
+    fprintf(stderr, "%s: tablebase file does not match this build\n", filename);
+    close(fd);
+    return false;
+  }
+
+  void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    perror(filename);
+    return false;
+  }
+  // probes jump all over the tables
+  madvise(mem, st.st_size, MADV_RANDOM);
+
+  tb_unload();
+  tb_mapping = mem;
+  tb_mapping_bytes = st.st_size;
+  attach_tables(mem, header.max_pawns);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// Generation
+// ----------------------------------------------------------------------------
+
+// Scores a move that zapped a piece from the point of view of the side that
+// made it, whose color is stm.  The position c after the move is either
+// over or in a group with fewer Pawns.
+static bool zapping_move_value(position_t* c, color_t stm, int* result,
+                               int* distance) {
+  if (ptype_of(c->victims.zapped) == KING) {
+    *result = color_of(c->victims.zapped) == stm ? -1 : 1;
+    *distance = 1;
+    return true;
+  }
+  if (!tb_probe(c, result, distance)) {
+    tbassert(false, "missing smaller table\n");
+    return false;
+  }
+  *result = -*result;
+  *distance += 1;
+  return true;
+}
+
+// The value of a position none of whose moves to this group lead to a
+// position the opponent cannot win.  The last of those wins took d - 1
+// plies.
+static tbValue_t resolved_value(tbGen_t* g, uint64_t idx, int d) {
+  if (g->conv_win[idx]) {
+    return TB_WIN(g->conv_win[idx]);
+  }
+  if (g->conv_loss[idx] & TB_CONV_DRAW) {
+    return TB_DRAW;
+  }
+  int loss = g->conv_loss[idx] > d ? g->conv_loss[idx] : d;
+  return loss > 0 ? TB_LOSS(loss) : TB_DRAW;
+}
+
+// Makes every move of position idx.  Moves that zap something are scored
+// right away; the others, which stay in the group, are counted, to be
+// resolved by retro_position.
+static void init_position(tbGen_t* g, uint64_t idx) {
+  tbPieces_t pc;
+  if (!pieces_of_index(g->num_pawns, idx, &pc)) {
+    g->value[idx] = TB_INVALID;
+    return;
+  }
+
+  position_t p, c;
+  position_of_pieces(&pc, &p);
+  sortable_move_t moves[MAX_NUM_MOVES];
+  int num_moves = generate_all(&p, moves, true);
+
+  int count = 0;
+  int win = 0;
+  int loss = 0;
+  bool draw = false;
+  for (int i = 0; i < num_moves; i++) {
+    victims_t victims = make_move(&p, &c, get_move(moves[i]));
+    if (is_KO(victims)) {
+      continue;
+    }
+    if (victims.zapped_count == 0) {
+      count++;
+      continue;
+    }
+
+    int result, distance;
+    if (!zapping_move_value(&c, pc.stm, &result, &distance) ||
+        result == 0 || distance > TB_MAX_DIST) {
+      draw = true;
+    } else if (result > 0) {
+      win = (win == 0 || distance < win) ? distance : win;
+    } else {
+      loss = distance > loss ? distance : loss;
+    }
+  }
+
+  tbassert(count <= UINT8_MAX, "count: %d\n", count);
+  g->count[idx] = count;
+  g->conv_win[idx] = win;
+  g->conv_loss[idx] = loss | (draw ? TB_CONV_DRAW : 0);
+  g->value[idx] = count == 0 ? resolved_value(g, idx, 0) : TB_DRAW;
+}
+
+// Adds the index of q to preds if the move mv takes q to position idx without
+// zapping anything.  Returns the number of indices added.
+static int try_unmove(tbPieces_t* q, move_t mv, uint64_t idx,
+                      uint64_t* preds) {
+  position_t p, c;
+  sort_pawns(q);
+  position_of_pieces(q, &p);
+  if (!is_generated_move(&p, mv)) {
+    return 0;
+  }
+  victims_t victims = make_move(&p, &c, mv);
+  if (is_KO(victims) || victims.zapped_count > 0 ||
+      index_of_position(&c) != idx) {
+    return 0;
+  }
+  *preds = index_of_position(&p);
+  return 1;
+}
+
+static int piece_at(tbPieces_t* pc, square_t sq) {
+  for (int i = 0; i < pc->num_pieces; i++) {
+    if (pc->sq[i] == sq) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void rotate_back(piece_t* x, int rot) {
+  set_ori(x, ori_of(*x) + NUM_ORI - rot);
+}
+
+// Collects the indices of the positions from which the side that just moved
+// reaches position idx of the group without zapping anything, once per move
+// that does so.  These are the moves the init_position counts are made of.
+// The side that just moved is Black, so the predecessors are indexed as
+// their color-swapped images.
+static int predecessors(tbPieces_t* pc, uint64_t idx,
+                        uint64_t* preds) {
+  position_t p;
+  position_of_pieces(pc, &p);
+  color_t mover = opp_color(pc->stm);
+  int n = 0;
+
+  for (int k = 0; k < pc->num_pieces; k++) {
+    if (color_of(pc->piece[k]) != mover) {
+      continue;
+    }
+    square_t sq = pc->sq[k];
+    ptype_t typ = ptype_of(pc->piece[k]);
+
+    for (int i = 0; i < 8; i++) {
+      square_t nb = sq + dir_of(i);
+      ptype_t nb_typ = ptype_of(p.board[nb]);
+
+      if (nb_typ == EMPTY) {
+        // a move from the empty neighbor ...
+        tbPieces_t q = *pc;
+        q.stm = mover;
+        q.sq[k] = nb;
+        n += try_unmove(&q, move_of(typ, NONE, nb, nb, sq), idx, preds + n);
+
+        // ... or a swap-move with an enemy piece that stood there
+        for (int j = 0; j < 8; j++) {
+          square_t from_sq = nb + dir_of(j);
+          int other = piece_at(pc, from_sq);
+          if (from_sq == sq || other < 0 ||
+              color_of(pc->piece[other]) == mover) {
+            continue;
+          }
+          q = *pc;
+          q.stm = mover;
+          q.sq[k] = from_sq;
+          q.sq[other] = nb;
+          n += try_unmove(&q, move_of(typ, NONE, from_sq, nb, sq), idx,
+                          preds + n);
+        }
+      } else if (nb_typ != INVALID && color_of(p.board[nb]) != mover) {
+        // a swap-rotate with the enemy piece on the neighbor
+        int other = piece_at(pc, nb);
+        for (int rot = 1; rot < NUM_ORI; rot++) {
+          tbPieces_t q = *pc;
+          q.stm = mover;
+          q.sq[k] = nb;
+          rotate_back(&q.piece[k], rot);
+          q.sq[other] = sq;
+          n += try_unmove(&q, move_of(typ, rot, nb, sq, sq), idx, preds + n);
+        }
+      }
+    }
+
+    // a rotation in place
+    for (int rot = 1; rot < NUM_ORI; rot++) {
+      tbPieces_t q = *pc;
+      q.stm = mover;
+      rotate_back(&q.piece[k], rot);
+      n += try_unmove(&q, move_of(typ, rot, sq, sq, sq), idx, preds + n);
+    }
+  }
+  tbassert(n <= MAX_NUM_MOVES, "n: %d\n", n);
+  return n;
+}
+
+// Step d of the retrograde analysis: once every position won or lost in
+// fewer than d plies is known, the ones won or lost in d plies follow from
+// them.  A position that moves to a loss of the opponent in d - 1 plies wins
+// in d.  A position whose last move to this group not lost by the opponent
+// has just been ruled out loses in d, unless a zapping move does better.
+static void retro_position(tbGen_t* g, uint64_t idx, int d) {
+  tbValue_t v = g->value[idx];
+  if (v == TB_DRAW) {
+    if (g->conv_win[idx] == d) {
+      __sync_bool_compare_and_swap(&g->value[idx], TB_DRAW, TB_WIN(d));
+    }
+    return;
+  }
+  if (d == 1 || (v != TB_WIN(d - 1) && v != TB_LOSS(d - 1))) {
+    return;
+  }
+
+  tbPieces_t pc;
+  pieces_of_index(g->num_pawns, idx, &pc);
+  uint64_t preds[MAX_NUM_MOVES];
+  int num_preds = predecessors(&pc, idx, preds);
+
+  for (int i = 0; i < num_preds; i++) {
+    uint64_t q = preds[i];
+    if (v == TB_LOSS(d - 1)) {
+      __sync_bool_compare_and_swap(&g->value[q], TB_DRAW, TB_WIN(d));
+    } else if (__sync_sub_and_fetch(&g->count[q], 1) == 0) {
+      __sync_bool_compare_and_swap(&g->value[q], TB_DRAW,
+                                   resolved_value(g, q, d));
+    }
+  }
+}
+
+static tbValue_t* generate_group(int num_pawns) {
+  tbGen_t g;
+  g.num_pawns = num_pawns;
+  g.size = group_size(num_pawns);
+  g.value = malloc(g.size);
+  g.count = malloc(g.size);
+  g.conv_win = malloc(g.size);
+  g.conv_loss = malloc(g.size);
+  if (g.value == NULL || g.count == NULL || g.conv_win == NULL ||
+      g.conv_loss == NULL) {
+    fprintf(stderr, "Out of memory for a %"PRIu64" byte table\n", g.size);
+    free(g.value);
+    free(g.count);
+    free(g.conv_win);
+    free(g.conv_loss);
+    return NULL;
+  }
+
+  double start = milliseconds();
+  cilk_for (uint64_t idx = 0; idx < g.size; idx++) {
+    init_position(&g, idx);
+  }
+  for (int d = 1; d <= TB_MAX_DIST; d++) {
+    cilk_for (uint64_t idx = 0; idx < g.size; idx++) {
+      retro_position(&g, idx, d);
+    }
+  }
+
+  uint64_t wins = 0, losses = 0, draws = 0;
+  int longest = 0;
+  for (uint64_t idx = 0; idx < g.size; idx++) {
+    int result, distance;
+    if (decode_value(g.value[idx], &result, &distance)) {
+      wins += result > 0;
+      losses += result < 0;
+      draws += result == 0;
+      longest = distance > longest ? distance : longest;
+    }
+  }
+  printf("info string tablebase %d pawns: %"PRIu64" wins %"PRIu64
+         " losses %"PRIu64" draws, longest %d plies, %.0f ms\n",
+         num_pawns, wins, losses, draws, longest, milliseconds() - start);
+
+  free(g.count);
+  free(g.conv_win);
+  free(g.conv_loss);
+  return g.value;
+}
+
+bool tb_generate(int max_pawns, const char* filename) {
+  if (max_pawns < 0 || max_pawns > TB_MAX_PAWNS) {
+    fprintf(stderr, "Tablebases cover at most %d Pawns\n", TB_MAX_PAWNS);
+    return false;
+  }
+  tb_unload();
+  tb_history.key = 0;
+  tb_history.victims.zapped_count = 1;
+  tb_history.history = NULL;
+
+  // Zapping a Pawn leads to a group with fewer Pawns, so those come first.
+  tbValue_t* built[TB_MAX_PAWNS + 1];
+  memset(built, 0, sizeof(built));
+  bool ok = true;
+  for (int n = 0; n <= max_pawns && ok; n++) {
+    built[n] = generate_group(n);
+    tb_values[n] = built[n];
+    ok = built[n] != NULL;
+    tb_max_pawns = n;
+  }
+
+  if (ok) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    tbFileHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TB_FILE_MAGIC, sizeof(header.magic));
+    header.version = TB_FILE_VERSION;
+    header.max_pawns = max_pawns;
+    ok = fd >= 0 && write(fd, &header, sizeof(header)) == sizeof(header);
+    for (int n = 0; n <= max_pawns && ok; n++) {
+      ok = write(fd, built[n], group_size(n)) == (ssize_t) group_size(n);
+    }
+    if (!ok) {
+      perror(filename);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  for (int n = 0; n <= TB_MAX_PAWNS; n++) {
+    free(built[n]);
+  }
+  tb_unload();
+  return ok && tb_load(filename);
+}
@@ -0,0 +1,30 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Endgame tablebases
+
+#ifndef TABLEBASE_H
+#define TABLEBASE_H
+
+#include <stdbool.h>
+
+#include "./move_gen.h"
+
+// The tables cover every position with both Kings and at most TB_MAX_PAWNS
+// Pawns, in every orientation.  Each extra Pawn multiplies the size of a
+// table by 256, so one Pawn (16 MB per table) is as far as it goes.
+#define TB_MAX_PAWNS 1
+
+// Builds the tables for up to max_pawns Pawns by retrograde analysis, writes
+// them to filename, and loads the result.
+bool tb_generate(int max_pawns, const char* filename);
+
+// Memory-maps the tables in filename, replacing any loaded before.
+bool tb_load(const char* filename);
+
+// Looks up p.  Returns false if no loaded table covers p.  Otherwise sets
+// *result to 1 if the side to move wins, -1 if it loses, and 0 if neither
+// side can force a win, and *distance to the number of plies until the
+// losing King is zapped.
+bool tb_probe(position_t* p, int* result, int* distance);
+
+#endif  // TABLEBASE_H
@@ -0,0 +1,109 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+#include "./time_manager.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "./move_gen.h"
+#include "./search.h"
+
+// A best move that changed in the last iteration adds this much of the goal
+// to the budget.  Older changes count half as much each iteration.  The best
+// moves of the first two iterations are too shallow to count.
+#define INSTABILITY_WEIGHT 0.5
+
+// The budget never exceeds this multiple of the goal, which stays below the
+// hard limit of init_abort_timer, so that the iterations started are expected
+// to finish.
+#define MAX_BUDGET_RATIO 2.5
+
+// A best move that has not changed for two iterations and took this share of
+// the nodes of the last one, the others being refuted cheaply, dominates.
+// The budget is then cut to DOMINANT_BUDGET_RATIO of the goal.
+#define DOMINANT_SHARE 0.75
+#define DOMINANT_BUDGET_RATIO 0.5
+
+static double   goal;          // what the search should take, in ms
+static bool     pondering;     // the clock has not started yet
+static double   clock_start;   // when it started, in ms into the search
+static double   instability;   // recent changes of the best move, decaying
+static move_t   best_move;     // after the last iteration
+static int      stable;        // iterations since the best move changed
+static double   last_elapsed;  // when the last iteration ended
+static uint64_t last_nodes[2];  // nodes of the last two iterations
+
+double tm_goal(double time_left, double inc) {
+  double g = time_left * 0.02;  // use about 1/50 of main time
+  g += inc * 0.80;              // use most of increment
+  // sanity check,  make sure that we don't run ourselves too low
+  if (g * 10 > time_left) {
+    g = time_left / 10.0;
+  }
+  return g;
+}
+
+void tm_start(double g, bool ponder) {
+  goal = g;
+  pondering = ponder;
+  clock_start = 0.0;
+  instability = 0.0;
+  best_move = 0;
+  stable = 0;
+  last_elapsed = 0.0;
+  last_nodes[0] = 0;
+  last_nodes[1] = 0;
+}
+
+void tm_ponderhit(double elapsed) {
+  pondering = false;
+  clock_start = elapsed;
+}
+
+bool tm_next_iteration(int depth, double elapsed, uint64_t nodes,
+                       score_t score, rootMoveList* root_moves) {
+  double iteration_time = elapsed - last_elapsed;
+  last_elapsed = elapsed;
+
+  // The effective branching factor is how much the tree grows from one
+  // iteration to the next.  It swings between odd and even depths with
+  // alpha-beta, so it is taken over the last two iterations.
+  double ebf = 0.0;
+  if (depth >= 4 && last_nodes[1] > 0) {
+    ebf = sqrt((double) nodes / last_nodes[1]);
+  }
+  last_nodes[1] = last_nodes[0];
+  last_nodes[0] = nodes;
+
+  move_t mv = get_move(root_moves->moves[0]);
+  instability /= 2;
+  if (depth >= 3 && mv != best_move) {
+    instability += INSTABILITY_WEIGHT;
+    stable = 0;
+  } else {
+    stable++;
+  }
+  best_move = mv;
+
+  // Nothing to think about
+  if (root_moves->legal_count <= 1 || abs(score) >= WIN - MAX_PLY_IN_SEARCH) {
+    return false;
+  }
+  if (pondering) {
+    return true;
+  }
+
+  double budget = goal * (1.0 + instability);
+  if (budget > goal * MAX_BUDGET_RATIO) {
+    budget = goal * MAX_BUDGET_RATIO;
+  }
+  if (stable >= 2 && root_moves->nodes > 0 &&
+      root_moves->best_nodes >= DOMINANT_SHARE * root_moves->nodes) {
+    budget = goal * DOMINANT_BUDGET_RATIO;
+  }
+
+  // Until the branching factor is known, assume the next iteration takes as
+  // long as all the ones before it.
+  double next = (ebf > 0.0) ? iteration_time * ebf : elapsed;
+  return elapsed - clock_start + next <= budget;
+}
@@ -0,0 +1,43 @@
+// Copyright (c) 2015 MIT License by 6.172 Staff
+
+// Time management for searches against a clock
+//
+// A search is given a goal, the time it should take on average.  Its hard
+// limit, at which the search is aborted mid-iteration, is a multiple of the
+// goal (see init_abort_timer).  Between two iterations of iterative
+// deepening, the time manager decides whether the next one is worth
+// starting: it predicts what the next iteration will cost from the effective
+// branching factor of the last ones, and compares that with a budget that
+// grows while the best move keeps changing and shrinks while a single root
+// move dominates the search.
+//
+// A ponder search runs on the opponent's time, so its clock only starts at
+// ponderhit.  Until then every iteration is worth starting.
+
+#ifndef TIME_MANAGER_H
+#define TIME_MANAGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "./search.h"
+
+// The goal of a search with time_left on the clock and inc added after every
+// move, both in milliseconds.
+double tm_goal(double time_left, double inc);
+
+// Starts managing a search with the given goal, in milliseconds.  A ponder
+// search does not run against the clock until tm_ponderhit.
+void tm_start(double goal, bool ponder);
+
+// Starts the clock of a ponder search, elapsed milliseconds into it.
+void tm_ponderhit(double elapsed);
+
+// Reports an iteration of depth that ended elapsed milliseconds into the
+// search, after searching nodes nodes, with score and the root moves as
+// searchRoot left them.  Returns whether the next iteration should be
+// started.
+bool tm_next_iteration(int depth, double elapsed, uint64_t nodes,
+                       score_t score, rootMoveList* root_moves);
+
+#endif  // TIME_MANAGER_H
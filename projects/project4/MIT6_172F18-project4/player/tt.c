@@ -9,13 +9,41 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <cilk/cilk.h>
 #include "./tbassert.h"
+#include "./util.h"
 
 int HASH;     // hash table size in MBytes
 int USE_TT;   // Use the transposition table.
 // Turn off for deterministic behavior of the search.
+int HASH_PAGES;  // Page size requested for the table, see ttPageMode_t
+int TT_PREFETCH; // Prefetch the set of a child as soon as its key is known
+int SYM_TT;      // File positions under the key shared by their symmetric images
 
-// the actual record that holds the data for the transposition
+// 2 MB, the size of a huge page on x86-64
+#define HUGE_PAGE_SIZE (1ULL << 21)
+
+// header of a file written by tt_save_hashtable
+#define TT_FILE_MAGIC "LSCHSTT"
+#define TT_FILE_VERSION 1
+typedef struct {
+  char     magic[8];
+  uint32_t version;
+  uint32_t bytes_per_record;
+  uint32_t records_per_set;
+  uint32_t age;
+  uint64_t num_of_sets;
+  uint64_t zob_fingerprint;  // the table is only valid with the same keys
+} ttFileHeader_t;
+
+// number of sets cleared by one worker at a time
+#define CLEAR_CHUNK (HUGE_PAGE_SIZE / sizeof(ttSet_t))
+
+// the unpacked form of a record, handed out by tt_hashtable_get
 // typedef to be ttRec_t in tt.h
 struct ttRec {
   uint64_t  key;
@@ -26,12 +54,30 @@ struct ttRec {
   int       age;
 };
 
-
-// each set is a 4-way set-associative cache and contains 4 records
-#define RECORDS_PER_SET 1
+// A record as stored in the table: everything but the key is packed into
+// one 64-bit data word, and the key is stored XORed with it.  A reader that
+// races with a writer sees a key that does not match and treats the record
+// as a miss, so the table needs no locks.
+//
+// https://www.chessprogramming.org/Shared_Hash_Table#Lockless
+typedef struct {
+  uint64_t key_xor_data;
+  uint64_t data;
+} ttEntry_t;
+
+// layout of ttEntry_t.data
+#define TT_MOVE_SHIFT    0   // 28 bits, see MOVE_MASK
+#define TT_SCORE_SHIFT   28  // 16 bits
+#define TT_QUALITY_SHIFT 44  // 8 bits, signed
+#define TT_BOUND_SHIFT   52  // 2 bits
+#define TT_AGE_SHIFT     54  // 10 bits
+#define TT_AGE_MASK      0x3ff
+
+// each set is a 4-way set-associative cache that fills one cache line
+#define RECORDS_PER_SET 4
 typedef struct {
-  ttRec_t records[RECORDS_PER_SET];
-} ttSet_t;
+  ttEntry_t records[RECORDS_PER_SET];
+} __attribute__((aligned(64))) ttSet_t;
 
 
 // struct def for the global transposition table
@@ -40,8 +86,18 @@ struct ttHashtable {
   uint64_t mask;           // a mask to map from key to set index
   unsigned age;
   ttSet_t* tt_set;         // array of sets that contains the transposition
+  size_t   mapped_bytes;   // size of the mapping that holds tt_set
+  ttPageMode_t page_mode;  // page size we actually got
 } hashtable;  // name of the global transposition table
 
+// the record most recently returned by tt_hashtable_get on this thread
+static __thread ttRec_t found_rec;
+
+// probe latency counters, only kept while probe_timing is set
+static bool     probe_timing = false;
+static uint64_t probe_count;
+static uint64_t probe_cycles;
+
 
 // getting the move out of the record
 move_t tt_move_of(ttRec_t* rec) {
@@ -54,13 +110,95 @@ score_t tt_score_of(ttRec_t* rec) {
 }
 
 size_t tt_get_bytes_per_record() {
-  return sizeof(struct ttRec);
+  return sizeof(ttEntry_t);
 }
 
 uint32_t tt_get_num_of_records() {
   return hashtable.num_of_sets * RECORDS_PER_SET;
 }
 
+static const char* page_mode_names[] = {
+  "normal", "transparent huge", "explicit huge"
+};
+
+const char* tt_get_page_mode() {
+  return page_mode_names[hashtable.page_mode];
+}
+
+size_t tt_get_page_size() {
+  return hashtable.page_mode == TT_PAGES_NORMAL ?
+      (size_t) sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+}
+
+// Zeroes the table.  The workers each touch their own chunks, so on a fresh
+// mapping the pages are first touched, and thus placed, by all of them
+// rather than by the calling thread alone.
+static void tt_clear_sets() {
+  cilk_for (uint64_t i = 0; i < hashtable.num_of_sets; i += CLEAR_CHUNK) {
+    uint64_t n = hashtable.num_of_sets - i;
+    if (n > CLEAR_CHUNK) {
+      n = CLEAR_CHUNK;
+    }
+    memset(hashtable.tt_set + i, 0, sizeof(ttSet_t) * n);
+  }
+}
+
+// Maps bytes of memory for the table using the page size requested by
+// HASH_PAGES, falling back to smaller pages if the kernel refuses.  Huge-page
+// mappings are rounded up to a whole number of huge pages.
+static void tt_map_sets(size_t bytes) {
+  size_t huge_bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  void* mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+  if (HASH_PAGES == TT_PAGES_EXPLICIT_HUGE) {
+    mem = mmap(NULL, huge_bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+      hashtable.tt_set = (ttSet_t*) mem;
+      hashtable.mapped_bytes = huge_bytes;
+      hashtable.page_mode = TT_PAGES_EXPLICIT_HUGE;
+      return;
+    }
+  }
+#endif
+
+#ifdef MADV_HUGEPAGE
+  if (HASH_PAGES != TT_PAGES_NORMAL) {
+    // Over-allocate so that the table can start on a huge page boundary, and
+    // give the slack on either side back.
+    mem = mmap(NULL, huge_bytes + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+      uintptr_t start = (uintptr_t) mem;
+      uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+      if (aligned > start) {
+        munmap(mem, aligned - start);
+      }
+      munmap((void*) (aligned + huge_bytes),
+             start + HUGE_PAGE_SIZE - aligned);
+
+      hashtable.tt_set = (ttSet_t*) aligned;
+      hashtable.mapped_bytes = huge_bytes;
+      hashtable.page_mode = madvise(hashtable.tt_set, huge_bytes,
+                                    MADV_HUGEPAGE) == 0 ?
+          TT_PAGES_TRANSPARENT_HUGE : TT_PAGES_NORMAL;
+      return;
+    }
+  }
+#endif
+
+  mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    fprintf(stderr,  "Hash table too big\n");
+    exit(1);
+  }
+  hashtable.tt_set = (ttSet_t*) mem;
+  hashtable.mapped_bytes = bytes;
+  hashtable.page_mode = TT_PAGES_NORMAL;
+}
+
 void tt_resize_hashtable(int size_in_meg) {
   uint64_t size_in_bytes = (uint64_t) size_in_meg * (1ULL << 20);
   // total number of sets we could have in the hashtable
@@ -77,16 +215,11 @@ void tt_resize_hashtable(int size_in_meg) {
   hashtable.mask = num_of_sets - 1;
   hashtable.age = 0;
 
-  free(hashtable.tt_set);  // free the old ones
-  hashtable.tt_set = (ttSet_t*) malloc(sizeof(ttSet_t) * num_of_sets);
-
-  if (hashtable.tt_set == NULL) {
-    fprintf(stderr,  "Hash table too big\n");
-    exit(1);
-  }
+  tt_free_hashtable();  // free the old ones
+  tt_map_sets(sizeof(ttSet_t) * num_of_sets);
 
   // might as well clear the table while we are at it
-  memset(hashtable.tt_set, 0, sizeof(ttSet_t) * hashtable.num_of_sets);
+  tt_clear_sets();
 }
 
 void tt_make_hashtable(int size_in_meg) {
@@ -95,7 +228,9 @@ void tt_make_hashtable(int size_in_meg) {
 }
 
 void tt_free_hashtable() {
-  free(hashtable.tt_set);
+  if (hashtable.tt_set != NULL) {
+    munmap(hashtable.tt_set, hashtable.mapped_bytes);
+  }
   hashtable.tt_set = NULL;
 }
 
@@ -105,79 +240,253 @@ void tt_age_hashtable() {
 }
 
 void tt_clear_hashtable() {
-  memset(hashtable.tt_set, 0, sizeof(ttSet_t) * hashtable.num_of_sets);
+  tt_clear_sets();
   hashtable.age = 0;
 }
 
+// Writes the table to filename through a shared file mapping.  Returns false,
+// after printing why, if that fails.
+bool tt_save_hashtable(const char* filename) {
+  size_t table_bytes = sizeof(ttSet_t) * hashtable.num_of_sets;
+  size_t file_bytes = sizeof(ttFileHeader_t) + table_bytes;
+
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, file_bytes) != 0) {
+    perror(filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
 
-void tt_hashtable_put(uint64_t key, int depth, score_t score,
+  char* mem = mmap(NULL, file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    perror(filename);
+    return false;
+  }
+
+  ttFileHeader_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TT_FILE_MAGIC, sizeof(header.magic));
+  header.version = TT_FILE_VERSION;
+  header.bytes_per_record = tt_get_bytes_per_record();
+  header.records_per_set = RECORDS_PER_SET;
+  header.age = hashtable.age;
+  header.num_of_sets = hashtable.num_of_sets;
+  header.zob_fingerprint = zob_fingerprint();
+
+  memcpy(mem, &header, sizeof(header));
+  memcpy(mem + sizeof(header), hashtable.tt_set, table_bytes);
+  munmap(mem, file_bytes);
+  return true;
+}
+
+// Replaces the table with the one saved in filename.  The file is rejected,
+// and the table left alone, unless it was written by the same format version
+// with the same record layout, table size, and Zobrist keys.
+bool tt_load_hashtable(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+
+  if ((size_t) st.st_size < sizeof(ttFileHeader_t)) {
+    fprintf(stderr, "%s: not a transposition table file\n", filename);
+    close(fd);
+    return false;
+  }
+
+  char* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    perror(filename);
+    return false;
+  }
+
+  ttFileHeader_t header;
+  memcpy(&header, mem, sizeof(header));
+  size_t table_bytes = sizeof(ttSet_t) * header.num_of_sets;
+
+  bool ok = false;
+  if (memcmp(header.magic, TT_FILE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "%s: not a transposition table file\n", filename);
+  } else if (header.version != TT_FILE_VERSION ||
+             header.bytes_per_record != tt_get_bytes_per_record() ||
+             header.records_per_set != RECORDS_PER_SET) {
+    fprintf(stderr, "%s: format version %u with %u records of %u bytes per set, "
+            "expected version %d with %d records of %zu bytes\n", filename,
+            header.version, header.records_per_set, header.bytes_per_record,
+            TT_FILE_VERSION, RECORDS_PER_SET, tt_get_bytes_per_record());
+  } else if (header.num_of_sets != hashtable.num_of_sets) {
+    fprintf(stderr, "%s: table has %" PRIu64 " records, the hash option gives "
+            "%u\n", filename, header.num_of_sets * RECORDS_PER_SET,
+            tt_get_num_of_records());
+  } else if (header.zob_fingerprint != zob_fingerprint()) {
+    fprintf(stderr, "%s: written by a build with different Zobrist keys "
+            "(board layout or seed); save it again with this one\n",
+            filename);
+  } else if ((size_t) st.st_size != sizeof(header) + table_bytes) {
+    fprintf(stderr, "%s: truncated\n", filename);
+  } else {
+    memcpy(hashtable.tt_set, mem + sizeof(header), table_bytes);
+    hashtable.age = header.age;
+    ok = true;
+  }
+
+  munmap(mem, st.st_size);
+  return ok;
+}
+
+static uint64_t tt_pack(move_t move, score_t score, int quality,
+                        int bound_type, unsigned age) {
+  return ((uint64_t) (move & MOVE_MASK) << TT_MOVE_SHIFT) |
+         ((uint64_t) (uint16_t) score << TT_SCORE_SHIFT) |
+         ((uint64_t) (uint8_t) quality << TT_QUALITY_SHIFT) |
+         ((uint64_t) bound_type << TT_BOUND_SHIFT) |
+         ((uint64_t) (age & TT_AGE_MASK) << TT_AGE_SHIFT);
+}
+
+static void tt_unpack(uint64_t key, uint64_t data, ttRec_t* rec) {
+  rec->key = key;
+  rec->move = (data >> TT_MOVE_SHIFT) & MOVE_MASK;
+  rec->score = (score_t) (uint16_t) (data >> TT_SCORE_SHIFT);
+  rec->quality = (int8_t) (uint8_t) (data >> TT_QUALITY_SHIFT);
+  rec->bound = (ttBound_t) ((data >> TT_BOUND_SHIFT) & 3);
+  rec->age = (data >> TT_AGE_SHIFT) & TT_AGE_MASK;
+}
+
+// Reads one entry.  Returns the key it holds, or a garbage key if a writer
+// got in between the two loads.
+static uint64_t tt_load(ttEntry_t* entry, uint64_t* data) {
+  uint64_t key_xor_data = __atomic_load_n(&entry->key_xor_data, __ATOMIC_RELAXED);
+  *data = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+  return key_xor_data ^ *data;
+}
+
+static void tt_store(ttEntry_t* entry, uint64_t key, uint64_t data) {
+  __atomic_store_n(&entry->key_xor_data, key ^ data, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->data, data, __ATOMIC_RELAXED);
+}
+
+// Stores the record of key.  Returns true if that took the place of the record
+// of another position, which is a collision in the stats command.
+bool tt_hashtable_put(uint64_t key, int depth, score_t score,
                       int bound_type, move_t move) {
   tbassert(abs(score) != INF, "Score was infinite.\n");
 
   uint64_t set_index = key & hashtable.mask;
+  unsigned age = hashtable.age & TT_AGE_MASK;
   // current record that we are looking into
-  ttRec_t* curr_rec = hashtable.tt_set[set_index].records;
-  // best record to replace that we found so far
-  ttRec_t* rec_to_replace = curr_rec;
+  ttEntry_t* curr_rec = hashtable.tt_set[set_index].records;
+  // best record to replace that we found so far, and its depth
+  ttEntry_t* rec_to_replace = curr_rec;
+  int replace_quality = 0;
   int replacemt_val = -99;            // value of doing the replacement
 
   move = move & MOVE_MASK;
 
   for (int i = 0; i < RECORDS_PER_SET; i++, curr_rec++) {
     int value = 0;  // points for sorting
+    uint64_t data;
+    uint64_t curr_key = tt_load(curr_rec, &data);
+    ttRec_t curr;
+    tt_unpack(curr_key, data, &curr);
 
     // always use entry if it's not used or has same key
-    if (!curr_rec->key || key == curr_rec->key) {
-      if (move == 0) {
-        move = curr_rec->move;
+    if (!curr_key || key == curr_key) {
+      if (move == 0 && curr_key) {
+        move = curr.move;
       }
-      curr_rec->key = key;
-      curr_rec->quality = depth;
-      curr_rec->move = move;
-      curr_rec->age = hashtable.age;
-      curr_rec->score = score;
-      curr_rec->bound = (ttBound_t) bound_type;
-
-      return;
+      tt_store(curr_rec, key, tt_pack(move, score, depth, bound_type, age));
+      return false;
     }
 
     // otherwise, potential candidate for replacement
-    if (curr_rec->age == hashtable.age) {
+    if (curr.age == age) {
       value -= 6;   // prefer not to replace if same age
     }
-    if (curr_rec->quality < rec_to_replace->quality) {
+    if (i > 0 && curr.quality < replace_quality) {
       value += 1;   // prefer to replace if worse quality
     }
     if (value > replacemt_val) {
       replacemt_val = value;
       rec_to_replace = curr_rec;
+      replace_quality = curr.quality;
     }
   }
   // update the record that we are replacing with this record
-  rec_to_replace->key = key;
-  rec_to_replace->quality = depth;
-  rec_to_replace->move = move;
-  rec_to_replace->age = hashtable.age;
-  rec_to_replace->score = score;
-  rec_to_replace->bound = (ttBound_t) bound_type;
+  tt_store(rec_to_replace, key, tt_pack(move, score, depth, bound_type, age));
+  return true;
 }
 
 
-ttRec_t* tt_hashtable_get(uint64_t key) {
-  if (!USE_TT) {
-    return NULL;  // done if we are not using the transposition table
+// The key the table files p under.  With sym_tt, that is its canonical key,
+// and the moves stored are those of the canonical image, which *sym maps p to.
+uint64_t tt_key_of(position_t* p, int* sym) {
+  if (SYM_TT) {
+    return canonical_key(p, sym);
   }
+  *sym = 0;
+  return p->key;
+}
 
+// Starts the set of key on its way into the cache ahead of tt_hashtable_get.
+// The keys of children are not canonical, so there is nothing to prefetch
+// with sym_tt.
+void tt_prefetch(uint64_t key) {
+  if (TT_PREFETCH && !SYM_TT) {
+    __builtin_prefetch(&hashtable.tt_set[key & hashtable.mask]);
+  }
+}
+
+static ttRec_t* tt_probe(uint64_t key) {
   uint64_t set_index = key & hashtable.mask;
-  ttRec_t* rec = hashtable.tt_set[set_index].records;
+  ttEntry_t* rec = hashtable.tt_set[set_index].records;
 
-  ttRec_t* found = NULL;
   for (int i = 0; i < RECORDS_PER_SET; i++, rec++) {
-    if (rec->key == key) {  // found the record that we are looking for
-      found = rec;
+    uint64_t data;
+    if (tt_load(rec, &data) == key) {  // found the record that we are looking for
+      tt_unpack(key, data, &found_rec);
+      return &found_rec;
     }
   }
-  return found;
+  return NULL;
+}
+
+// Returns a copy of the record for key, valid until the next call on the same
+// thread, or NULL if there is none.
+ttRec_t* tt_hashtable_get(uint64_t key) {
+  if (!USE_TT) {
+    return NULL;  // done if we are not using the transposition table
+  }
+
+  if (!probe_timing) {
+    return tt_probe(key);
+  }
+
+  uint64_t start = read_cycle_counter();
+  ttRec_t* rec = tt_probe(key);
+  __sync_fetch_and_add(&probe_cycles, read_cycle_counter() - start);
+  __sync_fetch_and_add(&probe_count, 1);
+  return rec;
+}
+
+// Zeroes the probe latency counters and turns timing on or off.
+void tt_reset_probe_timing(bool on) {
+  probe_count = 0;
+  probe_cycles = 0;
+  probe_timing = on;
+}
+
+void tt_get_probe_timing(uint64_t* probes, uint64_t* cycles) {
+  *probes = probe_count;
+  *cycles = probe_cycles;
 }
 
 
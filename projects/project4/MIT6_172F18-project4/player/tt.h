@@ -21,6 +21,14 @@ typedef enum {
   EXACT
 } ttBound_t;
 
+// Page sizes for the table (the hash_pages option).  Each mode falls back to
+// the next smaller one if the kernel refuses it.
+typedef enum {
+  TT_PAGES_NORMAL,
+  TT_PAGES_TRANSPARENT_HUGE,  // madvise(MADV_HUGEPAGE)
+  TT_PAGES_EXPLICIT_HUGE      // mmap(MAP_HUGETLB), needs reserved hugepages
+} ttPageMode_t;
+
 // Just forward declarations
 // The real definition is in tt.c
 typedef struct ttRec ttRec_t;
@@ -31,17 +39,28 @@ score_t tt_score_of(ttRec_t* tt);
 
 size_t tt_get_bytes_per_record();
 uint32_t tt_get_num_of_records();
+const char* tt_get_page_mode();
+size_t tt_get_page_size();
 
 // operations on the global hashtable
 void tt_make_hashtable(int sizeMeg);
 void tt_resize_hashtable(int sizeInMeg);
 void tt_free_hashtable();
 void tt_age_hashtable();
+void tt_clear_hashtable();
+bool tt_save_hashtable(const char* filename);
+bool tt_load_hashtable(const char* filename);
 
 // putting / getting transposition data into / from hashtable
-void tt_hashtable_put(uint64_t key, int depth, score_t score,
+bool tt_hashtable_put(uint64_t key, int depth, score_t score,
                       int type, move_t move);
 ttRec_t* tt_hashtable_get(uint64_t key);
+uint64_t tt_key_of(position_t* p, int* sym);
+void tt_prefetch(uint64_t key);
+
+// probe latency measurement, see the ttbench command
+void tt_reset_probe_timing(bool on);
+void tt_get_probe_timing(uint64_t* probes, uint64_t* cycles);
 
 score_t tt_adjust_score_from_hashtable(ttRec_t* rec, int ply);
 score_t tt_adjust_score_for_hashtable(score_t score, int ply);
@@ -9,8 +9,14 @@
   #include <sys/time.h>
 #endif
 
+#if !MACPORT
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
+#endif
+
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 int RESET_RNG;
@@ -42,6 +48,48 @@ double milliseconds() {
 #endif
 }
 
+// A cheap, monotonic cycle counter
+uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Starts counting the cache misses of the calling thread, and of the threads
+// it creates from now on.  Returns the counter, or -1 if the hardware
+// counters cannot be read, as in many virtual machines.
+int cache_miss_counter_start() {
+#if MACPORT
+  return -1;
+#else
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.inherit = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+
+// Stops counter, and returns the cache misses it counted, or -1 if there is no
+// count.
+int64_t cache_miss_counter_stop(int counter) {
+  if (counter < 0) {
+    return -1;
+  }
+  uint64_t count;
+  ssize_t n = read(counter, &count, sizeof(count));
+  close(counter);
+  return n == sizeof(count) ? (int64_t) count : -1;
+}
+
 // Public domain code for JLKISS64 RNG - long period KISS RNG producing
 // 64-bit results
 uint64_t myrand() {
@@ -32,5 +32,8 @@
 #endif
 void debug_log(int log_level, const char* str, ...);
 double  milliseconds();
+uint64_t read_cycle_counter();
 uint64_t myrand();
+int cache_miss_counter_start();
+int64_t cache_miss_counter_stop(int counter);
 #endif  // UTIL_H
@@ -56,7 +56,6 @@ extern int DETECT_DRAWS;
 
 // defined in eval.c
 extern int RANDOMIZE;
-extern int HATTACK;
 extern int PBETWEEN;
 extern int KFACE;
 extern int KAGGRESSIVE;
@@ -85,7 +84,6 @@ typedef struct {
 static int_options iopts[] = {
   // name                      variable    default                lower bound     upper bound
   // ---------------------------------------------------------------------------------------------
-  { "hattack",                 &HATTACK,   0.02 * PAWN_EV_VALUE,  0,              PAWN_EV_VALUE },
   { "mobility",               &MOBILITY,   0.02 * PAWN_EV_VALUE,  0,              PAWN_EV_VALUE },
   { "kaggressive",         &KAGGRESSIVE,   1.0 * PAWN_EV_VALUE,   0,              PAWN_EV_VALUE },
   { "kface",                     &KFACE,   0.3 * PAWN_EV_VALUE,   0,              PAWN_EV_VALUE },
@@ -110,8 +108,6 @@ static int_options iopts[] = {
 // Printing helpers
 // -----------------------------------------------------------------------------
 
-void getPV(move_t* pv, char* buf);
-
 int file_exists(const char* filename) {
   struct stat sbuf;
   return stat(filename, &sbuf) == 0;
@@ -182,6 +178,7 @@ typedef struct {
 
 void* entry_point(void* arg) {
   move_t subpv[MAX_PLY_IN_SEARCH];
+  rootMoveList root_moves;
 
   entry_point_args* real_arg = (entry_point_args*)arg;
   int depth = real_arg->depth;
@@ -201,7 +198,7 @@ void* entry_point(void* arg) {
   for (int d = 1; d <= depth; d++) {  // Iterative deepening
     reset_abort();
 
-    searchRoot(p, -INF, INF, d, 0, subpv, &node_count_serial,
+    searchRoot(p, -INF, INF, d, 0, &root_moves, subpv, &node_count_serial,
                OUT);
 
     et = elapsed_time();
@@ -432,7 +429,13 @@ void print_options() {
 // -----------------------------------------------------------------------------
 
 int main(int argc, char* argv[]) {
-  position_t* gme = (position_t*) malloc(sizeof(position_t) * MAX_PLY_IN_GAME);
+  // position_t is cache line aligned, which malloc does not guarantee
+  position_t* gme;
+  if (posix_memalign((void**) &gme, __alignof__(position_t),
+                     sizeof(position_t) * MAX_PLY_IN_GAME) != 0) {
+    fprintf(stderr, "Out of memory for the game\n");
+    return 1;
+  }
 
   setbuf(stdout, NULL);
   setbuf(stdin, NULL);
@@ -441,6 +444,8 @@ int main(int argc, char* argv[]) {
 
   init_options();
   init_zob();
+  init_coverage_tables();
+  init_search_threads(1);
 
 
   ///////////////////////////////////////////////////////////////////////////
@@ -495,7 +500,7 @@ int main(int argc, char* argv[]) {
         }
         printf("\n");
         if (victims.zapped_count > 0 &&
-            ptype_of(victims.zapped[victims.zapped_count - 1]) == KING) {
+            ptype_of(victims.zapped) == KING) {
           // goto is not harmful here since we must break nested loops.
           goto try_again;  // If King zapped, don't keep playing.
         }
@@ -781,7 +786,7 @@ int main(int argc, char* argv[]) {
         if (token_count >= 2) {  // Takes a depth argument to test deeper
           depth = strtol(tok[1], (char**)NULL, 10);
         }
-        do_perft(gme, depth, 0);
+        do_perft(gme, depth, 0, false, false, 0);
         continue;
       }
 